@@ -0,0 +1,201 @@
+#ifndef ATOMIC_POLYMORPHIC_VALUE_INCLUDE_H
+#define ATOMIC_POLYMORPHIC_VALUE_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace pmv {
+
+namespace detail {
+
+// Index of the reader counters used by the calling thread, so that threads
+// reading the same value don't all write to the same cache line
+inline std::size_t reader_stripe() noexcept
+{
+    static thread_local const std::size_t stripe
+        = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    return stripe;
+}
+
+} // namespace detail
+
+// Slot holding a Value (a polymorphic_value) that many threads read while
+// others replace it.
+//
+// Reads are wait-free: read() takes a read_guard, which keeps the current object
+// alive until it is destroyed. Writers are serialized, publish the new value
+// with a single pointer exchange and then wait for the readers that may still
+// see the old one, in the way of sleepable RCU: readers count themselves in one
+// of two sets of counters, chosen by an epoch that writers flip twice, waiting
+// each time for the previous set to drain.
+//
+// Writers wait for read guards, so a thread must not write while it holds one
+// on the same slot.
+template<typename Value, std::size_t Stripes = 16>
+class atomic_polymorphic_value {
+    static_assert(Stripes > 0, "At least one set of reader counters is needed");
+
+    struct node {
+        Value value;
+        std::uint64_t version;
+    };
+
+    // One cache line per stripe
+    struct alignas(64) reader_counters {
+        std::atomic<std::size_t> count[2] = {};
+    };
+
+public:
+    using value_type = Value;
+    using element_type = std::remove_reference_t<decltype(*std::declval<Value const&>())>;
+
+    // Access to the object published when it was taken
+    class read_guard {
+    public:
+        read_guard(read_guard&& o) noexcept
+            : m_node{o.m_node}
+            , m_counter{o.m_counter}
+        {
+            o.m_counter = nullptr;
+        }
+
+        read_guard& operator=(read_guard&& o) noexcept
+        {
+            if (&o != this) {
+                reset();
+                m_node = o.m_node;
+                m_counter = o.m_counter;
+                o.m_counter = nullptr;
+            }
+            return *this;
+        }
+
+        ~read_guard() { reset(); }
+
+        // Leave the read side critical section, the guard can't be used anymore
+        void reset() noexcept
+        {
+            if (m_counter) {
+                m_counter->fetch_sub(1, std::memory_order_release);
+                m_counter = nullptr;
+            }
+        }
+
+        Value const& value() const noexcept { return m_node->value; }
+        element_type* operator->() const noexcept { return &*m_node->value; }
+        element_type& operator*() const noexcept { return *m_node->value; }
+
+        // Identifies the published value, see compare_exchange
+        std::uint64_t version() const noexcept { return m_node->version; }
+
+    private:
+        friend class atomic_polymorphic_value;
+
+        read_guard(node const* n, std::atomic<std::size_t>* counter) noexcept
+            : m_node{n}
+            , m_counter{counter}
+        {
+        }
+
+        node const* m_node;
+        std::atomic<std::size_t>* m_counter;
+    };
+
+    explicit atomic_polymorphic_value(Value value)
+        : m_current{new node{std::move(value), 0}}
+    {
+    }
+
+    atomic_polymorphic_value(atomic_polymorphic_value const&) = delete;
+    atomic_polymorphic_value& operator=(atomic_polymorphic_value const&) = delete;
+
+    ~atomic_polymorphic_value() { delete m_current.load(std::memory_order_relaxed); }
+
+    read_guard read() const noexcept
+    {
+        auto const epoch = m_epoch.load(std::memory_order_seq_cst);
+        auto& counter = m_readers[detail::reader_stripe() % Stripes].count[epoch];
+        counter.fetch_add(1, std::memory_order_seq_cst);
+        return {m_current.load(std::memory_order_seq_cst), &counter};
+    }
+
+    // Replace the value, destroying the previous one once no reader sees it
+    void store(Value desired) { exchange(std::move(desired)); }
+
+    // Replace the value and return the previous one, once no reader sees it
+    Value exchange(Value desired)
+    {
+        std::unique_ptr<node> next{new node{std::move(desired), 0}};
+
+        std::lock_guard<std::mutex> lock{m_write_mutex};
+        return publish(std::move(next));
+    }
+
+    // Replace the value only if it is still the one with the given version,
+    // taken from a read_guard. desired is left untouched on failure, the check
+    // is done before the new value is built.
+    bool compare_exchange(std::uint64_t expected, Value& desired)
+    {
+        std::lock_guard<std::mutex> lock{m_write_mutex};
+        if (m_last_version != expected) {
+            return false;
+        }
+        publish(std::unique_ptr<node>{new node{std::move(desired), 0}});
+        return true;
+    }
+
+    // Version of the published value, read as a reader so that the node can't
+    // be deleted while it is read
+    std::uint64_t version() const noexcept { return read().version(); }
+
+private:
+    // Must be called with the write mutex held
+    Value publish(std::unique_ptr<node> next)
+    {
+        next->version = ++m_last_version;
+        std::unique_ptr<node> previous{
+            m_current.exchange(next.release(), std::memory_order_seq_cst)};
+        synchronize();
+        return std::move(previous->value);
+    }
+
+    // Wait until every reader that started before the call is done
+    void synchronize() noexcept
+    {
+        for (int i = 0; i < 2; ++i) {
+            auto const epoch = m_epoch.load(std::memory_order_relaxed);
+            m_epoch.store(epoch ^ 1, std::memory_order_seq_cst);
+            while (readers(epoch) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    std::size_t readers(unsigned epoch) const noexcept
+    {
+        std::size_t count = 0;
+        for (auto const& r : m_readers) {
+            count += r.count[epoch].load(std::memory_order_seq_cst);
+        }
+        return count;
+    }
+
+    mutable reader_counters m_readers[Stripes];
+    std::atomic<node*> m_current;
+    std::atomic<unsigned> m_epoch{0};
+    std::mutex m_write_mutex;
+    std::uint64_t m_last_version = 0;
+};
+
+} // pmv
+
+#endif // ATOMIC_POLYMORPHIC_VALUE_INCLUDE_H
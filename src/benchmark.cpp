@@ -0,0 +1,609 @@
+#include <benchmark/benchmark.h>
+
+#include "atomic_polymorphic_value.h"
+#include "closed_polymorphic_value.h"
+#include "inplace_polymorphic_value.h"
+#include "lazy_polymorphic_value.h"
+#include "parallel_algorithms.h"
+#include "polymorphic_value.h"
+#include "polymorphic_vector.h"
+#include "recycling_allocator.h"
+#include "slab_allocator.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+struct Base {
+    virtual ~Base() = default;
+    virtual int fn() const = 0;
+};
+
+struct Small : public Base {
+    int fn() const override { return value; }
+    int value = 1;
+};
+
+struct Small2 : public Base {
+    int fn() const override { return value * 2; }
+    int value = 2;
+};
+
+struct Big : public Base {
+    int fn() const override { return data[0]; }
+    int data[sizeof(void*) * 4] = {3};
+};
+
+// SBO configurations. Big is heap stored only in the default one.
+using pv_default = pmv::polymorphic_value<Base>;
+using pv_large = pmv::polymorphic_value<Base, true, 192>;
+using pv_large_aligned = pmv::polymorphic_value<Base, true, 192, 16>;
+using pv_no_alloc = pmv::polymorphic_value<Base, false, 192>;
+
+// Same buffer as pv_no_alloc, without any heap storage to check for
+using pv_inplace = pmv::inplace_polymorphic_value<Base, 192>;
+
+// operator-> is a single load instead of a branch on the storage type
+using pv_cached = pmv::polymorphic_value<Base,
+                                         true,
+                                         sizeof(void*) * 3,
+                                         alignof(void*),
+                                         std::allocator<char>,
+                                         pmv::cached_pointer_policy>;
+
+// Copies of Big share the heap object
+using pv_cow = pmv::polymorphic_value<Base,
+                                      true,
+                                      sizeof(void*) * 3,
+                                      alignof(void*),
+                                      std::allocator<char>,
+                                      pmv::copy_on_write_policy>;
+
+// Cross type copies are built on the stack and relocated
+using pv_strong = pmv::polymorphic_value<Base,
+                                         true,
+                                         sizeof(void*) * 3,
+                                         alignof(void*),
+                                         std::allocator<char>,
+                                         pmv::strong_exception_safety_policy>;
+
+// Same size as pv_default, with the vtable pointer first
+using pv_vtable_first = pmv::polymorphic_value<Base,
+                                               true,
+                                               sizeof(void*) * 3,
+                                               alignof(void*),
+                                               std::allocator<char>,
+                                               pmv::vtable_first_policy>;
+
+// Counts the operations going through the vtables, the cost of a minimal
+// tracer. Values without tracer, like pv_default, have unchanged vtables.
+struct counting_tracer {
+    static std::atomic<std::size_t> operations;
+
+    static void begin(pmv::trace_event const&) noexcept
+    {
+        operations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void end(pmv::trace_event const&) noexcept {}
+};
+
+std::atomic<std::size_t> counting_tracer::operations{0};
+
+struct traced_policy : pmv::default_policy {
+    using tracer = counting_tracer;
+};
+
+using pv_traced = pmv::polymorphic_value<Base,
+                                         true,
+                                         sizeof(void*) * 3,
+                                         alignof(void*),
+                                         std::allocator<char>,
+                                         traced_policy>;
+
+// Heap blocks of Big are recycled by a per thread cache
+using pv_recycling = pmv::polymorphic_value<Base,
+                                            true,
+                                            sizeof(void*) * 3,
+                                            alignof(void*),
+                                            pmv::recycling_allocator<char>>;
+
+// Heap objects of Big are next to each other in slabs
+using pv_slab = pmv::polymorphic_value<Base,
+                                       true,
+                                       sizeof(void*) * 3,
+                                       alignof(void*),
+                                       pmv::slab_allocator<char>>;
+
+// Objects are built on first access, BM_Construct measures values never used
+using pv_lazy = pmv::lazy_polymorphic_value<pv_default>;
+
+// Same set of types as variant_t, dispatched on a type index
+using pv_closed = pmv::closed_polymorphic_value<Base, Small, Small2, Big>;
+
+using variant_t = std::variant<Small, Small2, Big>;
+
+// Minimal deep copying pointer, as the usual alternative to polymorphic_value
+template<typename T>
+class clone_ptr {
+public:
+    template<typename Derived>
+    static clone_ptr make()
+    {
+        return clone_ptr{new Derived{}, [](T const& t) -> T* {
+                             return new Derived{static_cast<Derived const&>(t)};
+                         }};
+    }
+
+    clone_ptr(clone_ptr const& o) : m_ptr{o.m_clone(*o.m_ptr)}, m_clone{o.m_clone} {}
+
+    clone_ptr(clone_ptr&& o) noexcept : m_ptr{o.m_ptr}, m_clone{o.m_clone} { o.m_ptr = nullptr; }
+
+    clone_ptr& operator=(clone_ptr const& o)
+    {
+        if (&o != this) {
+            T* const ptr = o.m_clone(*o.m_ptr);
+            delete m_ptr;
+            m_ptr = ptr;
+            m_clone = o.m_clone;
+        }
+        return *this;
+    }
+
+    clone_ptr& operator=(clone_ptr&& o) noexcept
+    {
+        std::swap(m_ptr, o.m_ptr);
+        std::swap(m_clone, o.m_clone);
+        return *this;
+    }
+
+    ~clone_ptr() { delete m_ptr; }
+
+    T* operator->() const noexcept { return m_ptr; }
+
+private:
+    using clone_fn = T* (*)(T const&);
+
+    clone_ptr(T* ptr, clone_fn clone) noexcept : m_ptr{ptr}, m_clone{clone} {}
+
+    T* m_ptr;
+    clone_fn m_clone;
+};
+
+// Uniform way of building, modifying and calling every kind of value
+
+template<typename Value>
+struct adapter {
+    template<typename Derived>
+    static Value make()
+    {
+        return Value{pmv::in_place_type<Derived>};
+    }
+
+    template<typename Derived>
+    static void emplace(Value& v)
+    {
+        v.template emplace<Derived>();
+    }
+
+    static int call(Value const& v) { return v->fn(); }
+};
+
+template<>
+struct adapter<std::unique_ptr<Base>> {
+    template<typename Derived>
+    static std::unique_ptr<Base> make()
+    {
+        return std::make_unique<Derived>();
+    }
+
+    template<typename Derived>
+    static void emplace(std::unique_ptr<Base>& v)
+    {
+        v = std::make_unique<Derived>();
+    }
+
+    static int call(std::unique_ptr<Base> const& v) { return v->fn(); }
+};
+
+template<>
+struct adapter<clone_ptr<Base>> {
+    template<typename Derived>
+    static clone_ptr<Base> make()
+    {
+        return clone_ptr<Base>::make<Derived>();
+    }
+
+    template<typename Derived>
+    static void emplace(clone_ptr<Base>& v)
+    {
+        v = clone_ptr<Base>::make<Derived>();
+    }
+
+    static int call(clone_ptr<Base> const& v) { return v->fn(); }
+};
+
+template<>
+struct adapter<variant_t> {
+    template<typename Derived>
+    static variant_t make()
+    {
+        return variant_t{std::in_place_type<Derived>};
+    }
+
+    template<typename Derived>
+    static void emplace(variant_t& v)
+    {
+        v.emplace<Derived>();
+    }
+
+    static int call(variant_t const& v)
+    {
+        return std::visit([](auto const& d) { return d.fn(); }, v);
+    }
+};
+
+template<typename Value>
+std::vector<Value> make_mixed(std::size_t count)
+{
+    std::vector<Value> values;
+    values.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        switch (i % 3) {
+        case 0:
+            values.push_back(adapter<Value>::template make<Small>());
+            break;
+        case 1:
+            values.push_back(adapter<Value>::template make<Small2>());
+            break;
+        default:
+            values.push_back(adapter<Value>::template make<Big>());
+            break;
+        }
+    }
+    return values;
+}
+
+template<typename Value, typename Derived>
+void BM_Construct(benchmark::State& state)
+{
+    for (auto _ : state) {
+        auto v = adapter<Value>::template make<Derived>();
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+template<typename Value, typename Derived>
+void BM_Copy(benchmark::State& state)
+{
+    auto const src = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        Value copy{src};
+        benchmark::DoNotOptimize(copy);
+    }
+}
+
+template<typename Value, typename Derived>
+void BM_Move(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        Value tmp{std::move(v)};
+        v = std::move(tmp);
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+// Uses the member or ADL swap when there is one, three moves otherwise
+template<typename Value, typename Derived1, typename Derived2>
+void BM_Swap(benchmark::State& state)
+{
+    auto v1 = adapter<Value>::template make<Derived1>();
+    auto v2 = adapter<Value>::template make<Derived2>();
+    for (auto _ : state) {
+        using std::swap;
+        swap(v1, v2);
+        benchmark::DoNotOptimize(v1);
+        benchmark::DoNotOptimize(v2);
+    }
+}
+
+// Hits the m_vtable == src.m_vtable branch of the assignment operators
+template<typename Value, typename Derived>
+void BM_AssignSameType(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived>();
+    auto const src = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        v = src;
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+template<typename Value, typename Derived1, typename Derived2>
+void BM_AssignCrossType(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived1>();
+    auto const src1 = adapter<Value>::template make<Derived1>();
+    auto const src2 = adapter<Value>::template make<Derived2>();
+    for (auto _ : state) {
+        v = src2;
+        benchmark::DoNotOptimize(v);
+        v = src1;
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+template<typename Value, typename Derived1, typename Derived2>
+void BM_Emplace(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived1>();
+    for (auto _ : state) {
+        adapter<Value>::template emplace<Derived2>(v);
+        benchmark::DoNotOptimize(v);
+        adapter<Value>::template emplace<Derived1>(v);
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+template<typename Value, typename Derived>
+void BM_Dispatch(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(v);
+        benchmark::DoNotOptimize(adapter<Value>::call(v));
+    }
+}
+
+// Calls the functions of the types given to visit without virtual calls
+struct direct_call {
+    template<typename T>
+    int operator()(T const& t) const
+    {
+        return t.T::fn();
+    }
+
+    int operator()(Base const& b) const { return b.fn(); }
+};
+
+// Like BM_Dispatch, with visit instead of a virtual call
+template<typename Value, typename Derived>
+void BM_Visit(benchmark::State& state)
+{
+    auto v = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(v);
+        benchmark::DoNotOptimize(v.template visit<Small, Small2, Big>(direct_call{}));
+    }
+}
+
+// Move between values with different SBO sizes, there and back
+template<typename Value, typename Other, typename Derived>
+void BM_Convert(benchmark::State& state)
+{
+    Value v = adapter<Value>::template make<Derived>();
+    for (auto _ : state) {
+        Other tmp{std::move(v)};
+        v = std::move(tmp);
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+template<typename Value>
+void BM_VectorIterate(benchmark::State& state)
+{
+    auto const values = make_mixed<Value>(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        int sum = 0;
+        for (auto const& v : values) {
+            sum += adapter<Value>::call(v);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template<typename Value>
+void BM_VectorCopy(benchmark::State& state)
+{
+    auto const values = make_mixed<Value>(static_cast<std::size_t>(state.range(0)));
+    for (auto _ : state) {
+        auto copy = values;
+        benchmark::DoNotOptimize(copy.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Growth without reserve, dominated by moving the elements on reallocation
+template<typename Value>
+void BM_VectorGrowth(benchmark::State& state)
+{
+    auto const count = static_cast<std::size_t>(state.range(0));
+    for (auto _ : state) {
+        std::vector<Value> values;
+        for (std::size_t i = 0; i < count; ++i) {
+            values.push_back(adapter<Value>::template make<Small>());
+        }
+        benchmark::DoNotOptimize(values.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Values in runs of the same type, like a scene built one kind of node at a time
+std::vector<pv_default> make_runs(std::size_t count)
+{
+    std::vector<pv_default> values;
+    values.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i / 64 % 2) {
+            values.push_back(Small{});
+        } else {
+            values.push_back(Small2{});
+        }
+    }
+    return values;
+}
+
+// Copy and destroy an array of values one by one, or with the bulk operations
+template<bool Bulk>
+void BM_ArrayCopyDestroy(benchmark::State& state)
+{
+    auto const count = static_cast<std::size_t>(state.range(0));
+    auto const values = make_runs(count);
+    std::allocator<pv_default> alloc;
+    auto* const copies = alloc.allocate(count);
+    for (auto _ : state) {
+        if (Bulk) {
+            pmv::uninitialized_copy_n(values.data(), count, copies);
+            benchmark::DoNotOptimize(copies);
+            pmv::destroy_n(copies, count);
+        } else {
+            std::uninitialized_copy_n(values.data(), count, copies);
+            benchmark::DoNotOptimize(copies);
+            std::destroy_n(copies, count);
+        }
+    }
+    alloc.deallocate(copies, count);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Copy and destroy an array of values, copying chunks of it on range(1) threads
+void BM_ParallelArrayCopy(benchmark::State& state)
+{
+    auto const count = static_cast<std::size_t>(state.range(0));
+    auto const threads = static_cast<std::size_t>(state.range(1));
+    auto const values = make_runs(count);
+    std::allocator<pv_default> alloc;
+    auto* const copies = alloc.allocate(count);
+    for (auto _ : state) {
+        pmv::parallel_uninitialized_copy_n(values.data(), count, copies, threads);
+        benchmark::DoNotOptimize(copies);
+        pmv::destroy_n(copies, count);
+    }
+    alloc.deallocate(copies, count);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Read mostly slot shared by every thread of the benchmark
+pmv::atomic_polymorphic_value<pv_default> atomic_slot{pv_default{Small{}}};
+
+std::mutex locked_slot_mutex;
+pv_default locked_slot{Small{}};
+
+void BM_AtomicRead(benchmark::State& state)
+{
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(atomic_slot.read()->fn());
+    }
+}
+
+// Baseline for BM_AtomicRead, the same slot behind a mutex
+void BM_LockedRead(benchmark::State& state)
+{
+    for (auto _ : state) {
+        std::lock_guard<std::mutex> lock{locked_slot_mutex};
+        benchmark::DoNotOptimize(locked_slot->fn());
+    }
+}
+
+void BM_PolymorphicVectorIterate(benchmark::State& state)
+{
+    pmv::polymorphic_vector<Base> values;
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+        switch (i % 3) {
+        case 0:
+            values.emplace_back<Small>();
+            break;
+        case 1:
+            values.emplace_back<Small2>();
+            break;
+        default:
+            values.emplace_back<Big>();
+            break;
+        }
+    }
+
+    for (auto _ : state) {
+        int sum = 0;
+        values.for_each_by_type([&](Base const& v) { sum += v.fn(); });
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+constexpr std::int64_t small_container = 1 << 10;
+constexpr std::int64_t large_container = 1 << 16;
+
+} // namespace
+
+#define PMV_VALUE_BENCHMARKS(Value)                                                                \
+    BENCHMARK_TEMPLATE(BM_Construct, Value, Small);                                                \
+    BENCHMARK_TEMPLATE(BM_Construct, Value, Big);                                                  \
+    BENCHMARK_TEMPLATE(BM_Move, Value, Small);                                                     \
+    BENCHMARK_TEMPLATE(BM_Move, Value, Big);                                                       \
+    BENCHMARK_TEMPLATE(BM_Swap, Value, Small, Small2);                                             \
+    BENCHMARK_TEMPLATE(BM_Swap, Value, Small, Big);                                                \
+    BENCHMARK_TEMPLATE(BM_Swap, Value, Big, Big);                                                  \
+    BENCHMARK_TEMPLATE(BM_Emplace, Value, Small, Small2);                                          \
+    BENCHMARK_TEMPLATE(BM_Emplace, Value, Small, Big);                                             \
+    BENCHMARK_TEMPLATE(BM_Dispatch, Value, Small);                                                 \
+    BENCHMARK_TEMPLATE(BM_Dispatch, Value, Big);                                                   \
+    BENCHMARK_TEMPLATE(BM_VectorIterate, Value)->Arg(small_container)->Arg(large_container);       \
+    BENCHMARK_TEMPLATE(BM_VectorGrowth, Value)->Arg(small_container)->Arg(large_container)
+
+#define PMV_COPYABLE_VALUE_BENCHMARKS(Value)                                                       \
+    PMV_VALUE_BENCHMARKS(Value);                                                                   \
+    BENCHMARK_TEMPLATE(BM_Copy, Value, Small);                                                     \
+    BENCHMARK_TEMPLATE(BM_Copy, Value, Big);                                                       \
+    BENCHMARK_TEMPLATE(BM_AssignSameType, Value, Small);                                           \
+    BENCHMARK_TEMPLATE(BM_AssignSameType, Value, Big);                                             \
+    BENCHMARK_TEMPLATE(BM_AssignCrossType, Value, Small, Small2);                                  \
+    BENCHMARK_TEMPLATE(BM_AssignCrossType, Value, Small, Big);                                     \
+    BENCHMARK_TEMPLATE(BM_VectorCopy, Value)->Arg(small_container)->Arg(large_container)
+
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_default);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_large);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_large_aligned);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_no_alloc);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_inplace);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_cached);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_cow);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_strong);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_vtable_first);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_traced);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_closed);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_recycling);
+PMV_COPYABLE_VALUE_BENCHMARKS(pv_slab);
+PMV_COPYABLE_VALUE_BENCHMARKS(clone_ptr<Base>);
+PMV_COPYABLE_VALUE_BENCHMARKS(variant_t);
+PMV_VALUE_BENCHMARKS(std::unique_ptr<Base>);
+
+BENCHMARK_TEMPLATE(BM_Construct, pv_lazy, Small);
+BENCHMARK_TEMPLATE(BM_Construct, pv_lazy, Big);
+BENCHMARK_TEMPLATE(BM_Dispatch, pv_lazy, Big);
+
+BENCHMARK_TEMPLATE(BM_Visit, pv_default, Small);
+BENCHMARK_TEMPLATE(BM_Visit, pv_default, Big);
+BENCHMARK_TEMPLATE(BM_Visit, pv_cached, Big);
+
+BENCHMARK_TEMPLATE(BM_Convert, pv_default, pv_large, Small);
+BENCHMARK_TEMPLATE(BM_Convert, pv_default, pv_large, Big);
+BENCHMARK_TEMPLATE(BM_Convert, pv_large, pv_default, Big);
+
+BENCHMARK_TEMPLATE(BM_ArrayCopyDestroy, false)->Arg(small_container)->Arg(large_container);
+BENCHMARK_TEMPLATE(BM_ArrayCopyDestroy, true)->Arg(small_container)->Arg(large_container);
+BENCHMARK(BM_ParallelArrayCopy)->Args({large_container, 1})->Args({large_container, 4});
+
+BENCHMARK(BM_AtomicRead)->ThreadRange(1, 8);
+BENCHMARK(BM_LockedRead)->ThreadRange(1, 8);
+
+BENCHMARK(BM_PolymorphicVectorIterate)->Arg(small_container)->Arg(large_container);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,344 @@
+#ifndef CLOSED_POLYMORPHIC_VALUE_INCLUDE_H
+#define CLOSED_POLYMORPHIC_VALUE_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace pmv {
+
+namespace detail {
+
+template<typename T>
+struct type_tag {
+    using type = T;
+};
+
+template<typename T, typename... Types>
+struct is_one_of : std::false_type {
+};
+
+template<typename T, typename First, typename... Rest>
+struct is_one_of<T, First, Rest...>
+    : std::integral_constant<bool, std::is_same<T, First>::value || is_one_of<T, Rest...>::value> {
+};
+
+// Position of T in Types, which must contain it
+template<typename T, typename... Types>
+struct type_index;
+
+template<typename T, typename... Rest>
+struct type_index<T, T, Rest...> : std::integral_constant<std::size_t, 0> {
+};
+
+template<typename T, typename First, typename... Rest>
+struct type_index<T, First, Rest...>
+    : std::integral_constant<std::size_t, 1 + type_index<T, Rest...>::value> {
+};
+
+// Storage for an object of one of Types. The object is a member of the union
+// instead of bytes of a buffer, so it can be built in constant expressions.
+template<typename... Types>
+union object_union {
+};
+
+template<typename T, typename... Rest>
+union object_union<T, Rest...> {
+    // No object
+    constexpr object_union() noexcept {}
+    POLYMORPHIC_VALUE_CONSTEXPR ~object_union() {}
+
+    constexpr T* get(type_tag<T>) noexcept { return &first; }
+    constexpr T const* get(type_tag<T>) const noexcept { return &first; }
+
+    template<typename D>
+    constexpr D* get(type_tag<D> tag) noexcept
+    {
+        return rest.get(tag);
+    }
+
+    template<typename D>
+    constexpr D const* get(type_tag<D> tag) const noexcept
+    {
+        return rest.get(tag);
+    }
+
+    T first;
+    object_union<Rest...> rest;
+};
+
+// Placement new, or std::construct_at in constant expressions
+template<typename T, typename... Args>
+POLYMORPHIC_VALUE_CONSTEXPR T* construct_object(T* ptr, Args&&... args) noexcept(
+    std::is_nothrow_constructible<T, Args&&...>::value)
+{
+#if POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED
+    if (std::is_constant_evaluated()) {
+        return std::construct_at(ptr, std::forward<Args>(args)...);
+    }
+#endif
+    return new (ptr) T{std::forward<Args>(args)...};
+}
+
+// Call f with the type_tag of the index-th of Types. Once inlined, the chain
+// of comparisons is a switch on index, which compilers turn into a jump
+// table or, when all the cases are the same, into no branch at all.
+template<typename... Types>
+struct index_dispatch;
+
+template<typename T>
+struct index_dispatch<T> {
+    template<typename F>
+    POLYMORPHIC_VALUE_CONSTEXPR static decltype(auto) call(std::size_t, F&& f)
+    {
+        return f(type_tag<T>{});
+    }
+};
+
+template<typename T, typename Next, typename... Rest>
+struct index_dispatch<T, Next, Rest...> {
+    template<typename F>
+    POLYMORPHIC_VALUE_CONSTEXPR static decltype(auto) call(std::size_t index, F&& f)
+    {
+        if (index == 0) {
+            return f(type_tag<T>{});
+        }
+        return index_dispatch<Next, Rest...>::call(index - 1, std::forward<F>(f));
+    }
+};
+
+} // namespace detail
+
+// Value storing an object of one of a closed set of types derived from Base.
+// The object is always stored in the SBO buffer, sized for the largest of
+// them, and its type is a small index instead of a vtable pointer, so copies,
+// moves and destruction are dispatched with a switch that compilers can
+// inline, and visit() calls f with the object as its own type.
+//
+// Otherwise it works like polymorphic_value: it always holds an object, is
+// built from one of Derived or in place, and gives access to it as a Base.
+//
+// When POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED (C++20), values can be built,
+// used and destroyed in constant expressions, so tables of them can be
+// constexpr variables, placed in read only data without any initialization at
+// run time.
+template<typename Base, typename... Derived>
+class closed_polymorphic_value {
+    static_assert(std::is_polymorphic<Base>::value, "Class is not polymorphic");
+
+    using requirements = detail::sbo_requirements<Base, Derived...>;
+    using dispatch_t = detail::index_dispatch<Derived...>;
+    using index_t = std::conditional_t<sizeof...(Derived) <= UINT8_MAX, std::uint8_t, std::size_t>;
+
+    template<typename D>
+    using enable_if_derived_t
+        = std::enable_if_t<detail::is_one_of<std::decay_t<D>, Derived...>::value, bool>;
+
+public:
+    constexpr static std::size_t sbo_size = std::max(requirements::size, sizeof(void*));
+    constexpr static std::size_t sbo_alignment
+        = std::max(requirements::alignment, alignof(void*));
+
+    template<typename D, enable_if_derived_t<D> = true>
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value(D&& d) noexcept(
+        !detail::may_slice<D> && std::is_nothrow_constructible<std::decay_t<D>, D&&>::value)
+        : closed_polymorphic_value(unchecked, detail::check_slicing<D>(std::forward<D>(d)))
+    {
+    }
+
+    template<typename D, enable_if_derived_t<D> = true>
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value(unchecked_t, D&& d) noexcept(
+        std::is_nothrow_constructible<std::decay_t<D>, D&&>::value)
+    {
+        detail::assert_no_slicing<D>(d);
+        construct<std::decay_t<D>>(std::forward<D>(d));
+    }
+
+    template<typename D, typename... Args, enable_if_derived_t<D> = true>
+    POLYMORPHIC_VALUE_CONSTEXPR explicit closed_polymorphic_value(
+        in_place_type_t<D>,
+        Args&&... args) noexcept(std::is_nothrow_constructible<D, Args&&...>::value)
+    {
+        construct<D>(std::forward<Args>(args)...);
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value(closed_polymorphic_value const& src)
+    {
+        dispatch_t::call(src.m_index, [&](auto tag) {
+            using type = typename decltype(tag)::type;
+            construct<type>(*src.template get_as<type>());
+        });
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value(closed_polymorphic_value&& src) noexcept
+    {
+        dispatch_t::call(src.m_index, [&](auto tag) {
+            using type = typename decltype(tag)::type;
+            construct<type>(std::move(*src.template get_as<type>()));
+        });
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value& operator=(
+        closed_polymorphic_value const& src)
+    {
+        if (&src != this) {
+            dispatch_t::call(src.m_index, [&](auto tag) {
+                using type = typename decltype(tag)::type;
+                assign_object<type>(*src.template get_as<type>());
+            });
+        }
+        return *this;
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value& operator=(
+        closed_polymorphic_value&& src) noexcept
+    {
+        if (&src != this) {
+            dispatch_t::call(src.m_index, [&](auto tag) {
+                using type = typename decltype(tag)::type;
+                assign_object<type>(std::move(*src.template get_as<type>()));
+            });
+        }
+        return *this;
+    }
+
+    template<typename D, enable_if_derived_t<D> = true>
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value& operator=(D&& d)
+    {
+        return assign(unchecked, detail::check_slicing<D>(std::forward<D>(d)));
+    }
+
+    template<typename D, enable_if_derived_t<D> = true>
+    POLYMORPHIC_VALUE_CONSTEXPR closed_polymorphic_value& assign(unchecked_t, D&& d)
+    {
+        detail::assert_no_slicing<D>(d);
+        assign_object<std::decay_t<D>>(std::forward<D>(d));
+        return *this;
+    }
+
+    template<typename D, typename... Args>
+    POLYMORPHIC_VALUE_CONSTEXPR std::enable_if_t<detail::is_one_of<D, Derived...>::value> emplace(
+        Args&&... args) noexcept(
+        std::is_nothrow_constructible<D, Args&&...>::value)
+    {
+        replace<D>(std::forward<Args>(args)...);
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR ~closed_polymorphic_value() { destroy(); }
+
+    POLYMORPHIC_VALUE_CONSTEXPR Base* operator->() noexcept { return get(); }
+    POLYMORPHIC_VALUE_CONSTEXPR Base const* operator->() const noexcept { return get(); }
+    POLYMORPHIC_VALUE_CONSTEXPR Base& operator*() noexcept { return *get(); }
+    POLYMORPHIC_VALUE_CONSTEXPR Base const& operator*() const noexcept { return *get(); }
+
+    // Position of the type of the stored object in Derived
+    POLYMORPHIC_VALUE_CONSTEXPR std::size_t index() const noexcept { return m_index; }
+
+    template<typename D>
+    POLYMORPHIC_VALUE_CONSTEXPR bool holds() const noexcept
+    {
+        return m_index == detail::type_index<D, Derived...>::value;
+    }
+
+    // Call f with the stored object as its own type. f must return the same
+    // type for all of Derived.
+    template<typename F>
+    POLYMORPHIC_VALUE_CONSTEXPR decltype(auto) visit(F&& f)
+    {
+        return dispatch_t::call(m_index, [&](auto tag) -> decltype(auto) {
+            return f(*get_as<typename decltype(tag)::type>());
+        });
+    }
+
+    template<typename F>
+    POLYMORPHIC_VALUE_CONSTEXPR decltype(auto) visit(F&& f) const
+    {
+        return dispatch_t::call(m_index, [&](auto tag) -> decltype(auto) {
+            return f(*get_as<typename decltype(tag)::type>());
+        });
+    }
+
+private:
+    template<typename D>
+    POLYMORPHIC_VALUE_CONSTEXPR D* get_as() noexcept
+    {
+        return m_objects.get(detail::type_tag<D>{});
+    }
+
+    template<typename D>
+    POLYMORPHIC_VALUE_CONSTEXPR D const* get_as() const noexcept
+    {
+        return m_objects.get(detail::type_tag<D>{});
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR Base* get() noexcept
+    {
+        return dispatch_t::call(m_index, [this](auto tag) -> Base* {
+            return get_as<typename decltype(tag)::type>();
+        });
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR Base const* get() const noexcept
+    {
+        return dispatch_t::call(m_index, [this](auto tag) -> Base const* {
+            return get_as<typename decltype(tag)::type>();
+        });
+    }
+
+    // The storage must be empty
+    template<typename D, typename... Args>
+    POLYMORPHIC_VALUE_CONSTEXPR void construct(Args&&... args) noexcept(
+        std::is_nothrow_constructible<D, Args&&...>::value)
+    {
+        detail::construct_object(get_as<D>(), std::forward<Args>(args)...);
+        m_index = static_cast<index_t>(detail::type_index<D, Derived...>::value);
+    }
+
+    POLYMORPHIC_VALUE_CONSTEXPR void destroy() noexcept
+    {
+        dispatch_t::call(m_index, [this](auto tag) {
+            using type = typename decltype(tag)::type;
+            get_as<type>()->type::~type();
+        });
+    }
+
+    // Replace the object with a D. If building it may throw, it is built
+    // first so that the value keeps its object on failure.
+    template<typename D, typename... Args>
+    POLYMORPHIC_VALUE_CONSTEXPR void replace(Args&&... args) noexcept(
+        std::is_nothrow_constructible<D, Args&&...>::value)
+    {
+        if (std::is_nothrow_constructible<D, Args&&...>::value) {
+            destroy();
+            construct<D>(std::forward<Args>(args)...);
+        } else {
+            D tmp{std::forward<Args>(args)...};
+            destroy();
+            construct<D>(std::move(tmp));
+        }
+    }
+
+    // Assign to the object if it is a D, replace it otherwise
+    template<typename D, typename T>
+    POLYMORPHIC_VALUE_CONSTEXPR void assign_object(T&& src)
+    {
+        if (holds<D>()) {
+            *get_as<D>() = std::forward<T>(src);
+        } else {
+            replace<D>(std::forward<T>(src));
+        }
+    }
+
+    detail::object_union<Derived...> m_objects;
+    index_t m_index;
+};
+
+} // pmv
+
+#endif // CLOSED_POLYMORPHIC_VALUE_INCLUDE_H
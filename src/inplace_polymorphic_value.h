@@ -0,0 +1,329 @@
+#ifndef INPLACE_POLYMORPHIC_VALUE_INCLUDE_H
+#define INPLACE_POLYMORPHIC_VALUE_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace pmv {
+
+namespace detail {
+
+// Operations on an object stored in an inplace_polymorphic_value, called with
+// the address of the object, which is the buffer of the value
+struct inplace_vtable {
+    void (*destroy)(void* object) noexcept;
+    // Move construct into the empty dst. Null when the object is relocated by
+    // copying the buffer.
+    void (*move)(void* src, void* dst) noexcept;
+    void (*move_assign)(void* src, void* dst) noexcept;
+    void (*copy_construct)(void const* src, void* dst);
+    void (*copy_assign)(void const* src, void* dst);
+};
+
+namespace inplace_storage {
+
+template<typename Derived>
+inline void destroy(void* object) noexcept
+{
+    static_cast<Derived*>(object)->~Derived();
+}
+
+template<typename Derived>
+inline void move(void* src, void* dst) noexcept
+{
+    new (dst) Derived{std::move(*static_cast<Derived*>(src))};
+}
+
+template<typename Derived>
+inline void copy(void const* src, void* dst)
+{
+    new (dst) Derived{*static_cast<Derived const*>(src)};
+}
+
+// A relocated object leaves nothing behind, so all the operations on a moved
+// from value are no-ops
+inline void moved_from_destroy(void*) noexcept {}
+inline void moved_from_move(void*, void*) noexcept {}
+inline void moved_from_copy(void const*, void*) {}
+
+} // namespace inplace_storage
+
+// Static members, so that their addresses are constants
+template<typename Derived>
+struct inplace_vtable_for {
+    static const inplace_vtable value;
+};
+
+template<typename Derived>
+const inplace_vtable inplace_vtable_for<Derived>::value{
+    inplace_storage::destroy<Derived>,
+    is_trivially_relocatable<Derived>::value ? nullptr : inplace_storage::move<Derived>,
+    detail::move_assign<Derived>,
+    inplace_storage::copy<Derived>,
+    detail::copy_assign<Derived>,
+};
+
+// vtable of the values whose object was relocated into another value
+template<typename = void>
+struct inplace_moved_from_vtable {
+    static const inplace_vtable value;
+};
+
+template<typename T>
+const inplace_vtable inplace_moved_from_vtable<T>::value{
+    inplace_storage::moved_from_destroy,
+    inplace_storage::moved_from_move,
+    inplace_storage::moved_from_move,
+    inplace_storage::moved_from_copy,
+    inplace_storage::moved_from_copy,
+};
+
+} // namespace detail
+
+// Value storing an object derived from Base, always in its buffer of Size
+// bytes, for code that must never allocate, like real time threads. Unlike a
+// polymorphic_value without allocations, it has no heap machinery at all:
+// operator-> returns the buffer without checking where the object is, the
+// vtable only has the functions of local objects, and the value is exactly
+// its buffer followed by the vtable pointer, so sizeof is Size rounded up to
+// the alignment plus a pointer, padded when the alignment is larger than the
+// one of pointers.
+//
+// Types that don't fit in the buffer, are more aligned than it or whose move
+// constructor may throw don't compile. Otherwise it works like
+// polymorphic_value: it is built from one of Derived or in place, copies,
+// moves and assignments have the same guarantees, and moves relocate
+// trivially relocatable objects by copying the buffer.
+template<typename Base,
+         std::size_t Size = sizeof(void*) * 3,
+         std::size_t Alignment = alignof(void*)>
+class inplace_polymorphic_value {
+    static_assert(std::is_polymorphic<Base>::value, "Class is not polymorphic");
+
+    using vtable_t = detail::inplace_vtable;
+
+    template<typename Derived>
+    using enable_if_derived_t
+        = std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool>;
+
+public:
+    constexpr static std::size_t sbo_alignment = std::max(Alignment, alignof(void*));
+    constexpr static std::size_t sbo_size = detail::sbo_capacity(Size, sbo_alignment);
+
+    template<typename Derived, enable_if_derived_t<Derived> = true>
+    inplace_polymorphic_value(Derived&& d) noexcept(
+        !detail::may_slice<Derived>
+        && std::is_nothrow_constructible<std::decay_t<Derived>, Derived&&>::value)
+        : inplace_polymorphic_value(unchecked,
+                                    detail::check_slicing<Derived>(std::forward<Derived>(d)))
+    {
+    }
+
+    template<typename Derived, enable_if_derived_t<Derived> = true>
+    inplace_polymorphic_value(unchecked_t, Derived&& d) noexcept(
+        std::is_nothrow_constructible<std::decay_t<Derived>, Derived&&>::value)
+    {
+        detail::assert_no_slicing<Derived>(d);
+        construct<std::decay_t<Derived>>(std::forward<Derived>(d));
+    }
+
+    template<typename Derived, typename... Args, enable_if_derived_t<Derived> = true>
+    explicit inplace_polymorphic_value(in_place_type_t<Derived>, Args&&... args) noexcept(
+        std::is_nothrow_constructible<Derived, Args&&...>::value)
+    {
+        construct<Derived>(std::forward<Args>(args)...);
+    }
+
+    inplace_polymorphic_value(inplace_polymorphic_value const& src)
+    {
+        src.m_vtable->copy_construct(src.m_buffer, m_buffer);
+        m_vtable = src.m_vtable;
+    }
+
+    inplace_polymorphic_value(inplace_polymorphic_value&& src) noexcept { move_from(src); }
+
+    inplace_polymorphic_value& operator=(inplace_polymorphic_value const& src)
+    {
+        if (&src == this) {
+            return *this;
+        }
+
+        if (m_vtable == src.m_vtable) {
+            m_vtable->copy_assign(src.m_buffer, m_buffer);
+        } else {
+            destroy();
+            src.m_vtable->copy_construct(src.m_buffer, m_buffer);
+            m_vtable = src.m_vtable;
+        }
+        return *this;
+    }
+
+    inplace_polymorphic_value& operator=(inplace_polymorphic_value&& src) noexcept
+    {
+        if (&src == this) {
+            return *this;
+        }
+
+        if (m_vtable == src.m_vtable) {
+            m_vtable->move_assign(src.m_buffer, m_buffer);
+        } else {
+            m_vtable->destroy(m_buffer);
+            move_from(src);
+        }
+        return *this;
+    }
+
+    template<typename Derived, enable_if_derived_t<Derived> = true>
+    inplace_polymorphic_value& operator=(Derived&& d)
+    {
+        return assign(unchecked, detail::check_slicing<Derived>(std::forward<Derived>(d)));
+    }
+
+    // Assignment from an object without the slicing check
+    template<typename Derived, enable_if_derived_t<Derived> = true>
+    inplace_polymorphic_value& assign(unchecked_t, Derived&& d)
+    {
+        using derived_t = std::decay_t<Derived>;
+
+        detail::assert_no_slicing<derived_t>(d);
+        if (m_vtable == &detail::inplace_vtable_for<derived_t>::value) {
+            *get_as<derived_t>() = std::forward<Derived>(d);
+        } else {
+            destroy();
+            construct<derived_t>(std::forward<Derived>(d));
+        }
+        return *this;
+    }
+
+    // If building the object throws, the value is left moved from
+    template<typename Derived, typename... Args>
+    std::enable_if_t<std::is_base_of<Base, Derived>::value> emplace(Args&&... args) noexcept(
+        std::is_nothrow_constructible<Derived, Args&&...>::value)
+    {
+        destroy();
+        construct<Derived>(std::forward<Args>(args)...);
+    }
+
+    ~inplace_polymorphic_value() { m_vtable->destroy(m_buffer); }
+
+    // Exchange the objects, relocating them through a buffer on the stack
+    void swap(inplace_polymorphic_value& o) noexcept
+    {
+        if (&o == this) {
+            return;
+        }
+
+        alignas(sbo_alignment) unsigned char tmp[sbo_size];
+        relocate(m_vtable, m_buffer, tmp);
+        relocate(o.m_vtable, o.m_buffer, m_buffer);
+        relocate(m_vtable, tmp, o.m_buffer);
+        std::swap(m_vtable, o.m_vtable);
+    }
+
+    friend void swap(inplace_polymorphic_value& a, inplace_polymorphic_value& b) noexcept
+    {
+        a.swap(b);
+    }
+
+    Base* operator->() noexcept { return get(); }
+    Base const* operator->() const noexcept { return get(); }
+    Base& operator*() noexcept { return *get(); }
+    Base const& operator*() const noexcept { return *get(); }
+
+    // Whether the stored object is exactly a Derived
+    template<typename Derived>
+    bool holds() const noexcept
+    {
+        static_assert(std::is_base_of<Base, Derived>::value, "Type is not derived from Base");
+        return m_vtable == &detail::inplace_vtable_for<Derived>::value;
+    }
+
+    // The stored object if it is exactly a Derived, nullptr otherwise
+    template<typename Derived>
+    Derived* target() noexcept
+    {
+        return holds<Derived>() ? get_as<Derived>() : nullptr;
+    }
+
+    template<typename Derived>
+    Derived const* target() const noexcept
+    {
+        return holds<Derived>() ? get_as<Derived>() : nullptr;
+    }
+
+private:
+    Base* get() noexcept { return static_cast<Base*>(static_cast<void*>(m_buffer)); }
+
+    Base const* get() const noexcept
+    {
+        return static_cast<Base const*>(static_cast<void const*>(m_buffer));
+    }
+
+    template<typename Derived>
+    Derived* get_as() noexcept
+    {
+        return reinterpret_cast<Derived*>(m_buffer);
+    }
+
+    template<typename Derived>
+    Derived const* get_as() const noexcept
+    {
+        return reinterpret_cast<Derived const*>(m_buffer);
+    }
+
+    // The buffer must be empty. The value is moved from until the object is
+    // built, so that it stays destructible if building it throws.
+    template<typename Derived, typename... Args>
+    void construct(Args&&... args) noexcept(
+        std::is_nothrow_constructible<Derived, Args&&...>::value)
+    {
+        static_assert(detail::local_storage_check<inplace_polymorphic_value, Derived>::value, "");
+        m_vtable = &detail::inplace_moved_from_vtable<>::value;
+        new (m_buffer) Derived{std::forward<Args>(args)...};
+        m_vtable = &detail::inplace_vtable_for<Derived>::value;
+    }
+
+    void destroy() noexcept
+    {
+        m_vtable->destroy(m_buffer);
+        m_vtable = &detail::inplace_moved_from_vtable<>::value;
+    }
+
+    // Move the object of src into the empty buffer. Objects relocated by
+    // copying the buffer leave src moved from.
+    void move_from(inplace_polymorphic_value& src) noexcept
+    {
+        m_vtable = src.m_vtable;
+        if (m_vtable->move) {
+            m_vtable->move(src.m_buffer, m_buffer);
+        } else {
+            std::memcpy(m_buffer, src.m_buffer, sbo_size);
+            src.m_vtable = &detail::inplace_moved_from_vtable<>::value;
+        }
+    }
+
+    // Move the object in src, which has the given vtable, into the empty dst,
+    // leaving src empty
+    static void relocate(vtable_t const* vtable, void* src, void* dst) noexcept
+    {
+        if (vtable->move) {
+            vtable->move(src, dst);
+            vtable->destroy(src);
+        } else {
+            std::memcpy(dst, src, sbo_size);
+        }
+    }
+
+    alignas(sbo_alignment) unsigned char m_buffer[sbo_size];
+    vtable_t const* m_vtable;
+};
+
+} // pmv
+
+#endif // INPLACE_POLYMORPHIC_VALUE_INCLUDE_H
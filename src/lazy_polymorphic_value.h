@@ -0,0 +1,270 @@
+#ifndef LAZY_POLYMORPHIC_VALUE_INCLUDE_H
+#define LAZY_POLYMORPHIC_VALUE_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace pmv {
+
+namespace detail {
+
+// Builds a Value on demand
+template<typename Value>
+struct lazy_factory {
+    virtual ~lazy_factory() = default;
+    virtual Value make(typename Value::allocator_type const& alloc) = 0;
+};
+
+// Builds a Value holding a Derived from the constructor arguments, which are
+// moved into it. With RetryOnThrow they are passed as lvalues instead, so that
+// a construction that threw can be attempted again with the same arguments.
+template<typename Value, bool RetryOnThrow, typename Derived, typename... Args>
+struct lazy_factory_for final : lazy_factory<Value> {
+    template<typename... A>
+    explicit lazy_factory_for(A&&... a) : args{std::forward<A>(a)...}
+    {
+    }
+
+    Value make(typename Value::allocator_type const& alloc) override
+    {
+        return make(alloc, std::index_sequence_for<Args...>{});
+    }
+
+    template<std::size_t... I>
+    Value make(typename Value::allocator_type const& alloc, std::index_sequence<I...>)
+    {
+        return Value{std::allocator_arg, alloc, in_place_type<Derived>, argument<I>()...};
+    }
+
+    template<std::size_t I>
+    auto& argument(std::true_type /* retry on throw */) noexcept
+    {
+        return std::get<I>(args);
+    }
+
+    template<std::size_t I>
+    auto&& argument(std::false_type /* retry on throw */) noexcept
+    {
+        return std::move(std::get<I>(args));
+    }
+
+    template<std::size_t I>
+    decltype(auto) argument() noexcept
+    {
+        return argument<I>(std::integral_constant<bool, RetryOnThrow>{});
+    }
+
+    std::tuple<Args...> args;
+};
+
+} // namespace detail
+
+// Value (a polymorphic_value) whose object is built on first access. Until
+// then it stores the type and the arguments of the object, in a buffer of the
+// size of the one of Value, so values that are never dereferenced don't pay
+// for the construction of their object, nor for its allocation. The arguments
+// never go to the heap: they must fit in Value::sbo_size minus a pointer.
+//
+// Access through a const value builds the object too. With ThreadSafe, the
+// first access by any number of threads builds the object exactly once, and
+// publishes it to the others, which wait for it. Otherwise, as for other
+// const functions caching a result, concurrent first accesses race.
+//
+// If building the object throws, the exception is propagated and the value
+// stays unbuilt, to be built again on the next access. The arguments are moved
+// into the object, so that next attempt gets what the failed one left of them.
+// With RetryOnThrow, they are copied instead and every attempt gets the
+// original arguments, which must then be copy constructible.
+template<typename Value, bool ThreadSafe = false, bool RetryOnThrow = false>
+class lazy_polymorphic_value {
+    using factory_t = polymorphic_value<detail::lazy_factory<Value>,
+                                        false,
+                                        Value::sbo_size,
+                                        Value::sbo_alignment,
+                                        typename Value::allocator_type,
+                                        move_only_policy>;
+
+    enum class state : unsigned char { pending, building, built };
+
+    // Acquires the object published by the thread that built it
+    constexpr static auto load_order
+        = ThreadSafe ? std::memory_order_acquire : std::memory_order_relaxed;
+
+public:
+    using value_type = Value;
+    using allocator_type = typename Value::allocator_type;
+    using element_type = std::remove_reference_t<decltype(*std::declval<Value const&>())>;
+
+    template<typename Derived, typename... Args>
+    explicit lazy_polymorphic_value(in_place_type_t<Derived>, Args&&... args)
+        : lazy_polymorphic_value(std::allocator_arg,
+                                 allocator_type{},
+                                 in_place_type<Derived>,
+                                 std::forward<Args>(args)...)
+    {
+    }
+
+    template<typename Derived, typename... Args>
+    lazy_polymorphic_value(std::allocator_arg_t,
+                           allocator_type const& alloc,
+                           in_place_type_t<Derived>,
+                           Args&&... args)
+        : m_state{state::pending}
+    {
+        static_assert(std::is_base_of<element_type, Derived>::value,
+                      "Type is not derived from Base");
+        using factory_for
+            = detail::lazy_factory_for<Value, RetryOnThrow, Derived, std::decay_t<Args>...>;
+        using reasons = heap_storage_reasons<factory_t, factory_for>;
+        static_assert(!reasons::too_large,
+                      "Arguments are larger than Value::sbo_size minus the size of a pointer");
+        static_assert(!reasons::over_aligned,
+                      "Arguments are more aligned than Value::sbo_alignment");
+        static_assert(!reasons::throwing_move, "Argument move constructors may throw");
+        new (&m_factory) factory_t{
+            std::allocator_arg, alloc, in_place_type<factory_for>, std::forward<Args>(args)...};
+    }
+
+    // Already built
+    explicit lazy_polymorphic_value(Value value) noexcept : m_state{state::built}
+    {
+        new (&m_value) Value{std::move(value)};
+    }
+
+    // Unbuilt objects are built to be copied
+    lazy_polymorphic_value(lazy_polymorphic_value const& src) : m_state{state::built}
+    {
+        new (&m_value) Value{src.value()};
+    }
+
+    lazy_polymorphic_value(lazy_polymorphic_value&& src) noexcept { move_from(src); }
+
+    lazy_polymorphic_value& operator=(lazy_polymorphic_value const& src)
+    {
+        if (&src != this) {
+            *this = lazy_polymorphic_value{src};
+        }
+        return *this;
+    }
+
+    lazy_polymorphic_value& operator=(lazy_polymorphic_value&& src) noexcept
+    {
+        if (&src != this) {
+            destroy();
+            move_from(src);
+        }
+        return *this;
+    }
+
+    ~lazy_polymorphic_value() { destroy(); }
+
+    // Whether the object was built already
+    bool is_built() const noexcept { return m_state.load(load_order) == state::built; }
+
+    // The value holding the object, built first if needed
+    Value& value()
+    {
+        build();
+        return m_value;
+    }
+
+    Value const& value() const
+    {
+        build();
+        return m_value;
+    }
+
+    auto operator->() { return value().operator->(); }
+    auto operator->() const { return value().operator->(); }
+    decltype(auto) operator*() { return *value(); }
+    decltype(auto) operator*() const { return *value(); }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return is_built() ? m_value.get_allocator() : m_factory.get_allocator();
+    }
+
+private:
+    void build() const
+    {
+        if (m_state.load(load_order) != state::built) {
+            build(std::integral_constant<bool, ThreadSafe>{});
+        }
+    }
+
+    void build(std::false_type) const
+    {
+        replace_factory();
+        m_state.store(state::built, std::memory_order_relaxed);
+    }
+
+    // The first thread to leave the pending state builds the object, the
+    // others wait until it is built, or try again if building it threw
+    void build(std::true_type) const
+    {
+        auto expected = state::pending;
+        while (!m_state.compare_exchange_weak(
+            expected, state::building, std::memory_order_acquire, std::memory_order_acquire)) {
+            if (expected == state::built) {
+                return;
+            }
+            expected = state::pending;
+            std::this_thread::yield();
+        }
+
+        try {
+            replace_factory();
+        } catch (...) {
+            m_state.store(state::pending, std::memory_order_release);
+            throw;
+        }
+        m_state.store(state::built, std::memory_order_release);
+    }
+
+    // The factory is kept if building the value throws
+    void replace_factory() const
+    {
+        Value built = m_factory->make(m_factory.get_allocator());
+        m_factory.~factory_t();
+        new (&m_value) Value{std::move(built)};
+    }
+
+    void destroy() noexcept
+    {
+        if (is_built()) {
+            m_value.~Value();
+        } else {
+            m_factory.~factory_t();
+        }
+    }
+
+    // This value must be destroyed, src isn't accessed concurrently
+    void move_from(lazy_polymorphic_value& src) noexcept
+    {
+        if (src.is_built()) {
+            new (&m_value) Value{std::move(src.m_value)};
+            m_state.store(state::built, std::memory_order_relaxed);
+        } else {
+            new (&m_factory) factory_t{std::move(src.m_factory)};
+            m_state.store(state::pending, std::memory_order_relaxed);
+        }
+    }
+
+    union {
+        mutable factory_t m_factory;
+        mutable Value m_value;
+    };
+    mutable std::atomic<state> m_state;
+};
+
+} // pmv
+
+#endif // LAZY_POLYMORPHIC_VALUE_INCLUDE_H
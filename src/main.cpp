@@ -1,11 +1,29 @@
 #include <gtest/gtest.h>
 
+#include "atomic_polymorphic_value.h"
+#include "closed_polymorphic_value.h"
+#include "inplace_polymorphic_value.h"
+#include "lazy_polymorphic_value.h"
+#include "parallel_algorithms.h"
 #include "polymorphic_value.h"
-
+#include "polymorphic_vector.h"
+#include "recycling_allocator.h"
+#include "slab_allocator.h"
+#include "type_registry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <new>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 using namespace pmv;
 
@@ -13,6 +31,13 @@ static int new_call_counter = 0;
 static int delete_call_counter = 0;
 static bool enable_allocator_counters = false;
 
+// GCC flags the free in the replacement operator delete once it is inlined in
+// code that got its memory from the replacement operator new, which mallocs it
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
 void* operator new(std::size_t count)
 {
     if (enable_allocator_counters) {
@@ -41,6 +66,10 @@ void operator delete(void* ptr) noexcept
     return std::free(ptr);
 }
 
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
 struct Base {
     virtual ~Base() = default;
     virtual int fn() = 0;
@@ -1273,3 +1302,2532 @@ TEST(polymorphic_value, EmplaceFromBigToBig)
     EXPECT_EQ(new_call_counter, 2);
     EXPECT_EQ(delete_call_counter, 2);
 }
+
+struct allocation_stats {
+    int allocations = 0;
+    int deallocations = 0;
+};
+
+template<typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    explicit counting_allocator(allocation_stats* stats) noexcept : stats{stats} {}
+
+    template<typename U>
+    counting_allocator(counting_allocator<U> const& o) noexcept : stats{o.stats}
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        ++stats->allocations;
+        return static_cast<T*>(std::malloc(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t) noexcept
+    {
+        ++stats->deallocations;
+        std::free(ptr);
+    }
+
+    template<typename U>
+    bool operator==(counting_allocator<U> const& o) const noexcept
+    {
+        return stats == o.stats;
+    }
+
+    template<typename U>
+    bool operator!=(counting_allocator<U> const& o) const noexcept
+    {
+        return stats != o.stats;
+    }
+
+    allocation_stats* stats;
+};
+
+template<typename Base>
+using counting_polymorphic_value = polymorphic_value<Base,
+                                                     true,
+                                                     sizeof(void*) * 3,
+                                                     alignof(void*),
+                                                     counting_allocator<char>>;
+
+TEST(polymorphic_value, AllocatorSmallObject)
+{
+    allocation_stats stats;
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    {
+        enable_allocator_counters = true;
+        counting_polymorphic_value<Base> poly{
+            std::allocator_arg, counting_allocator<char>{&stats}, in_place_type<DerivedSmall>};
+        enable_allocator_counters = false;
+        EXPECT_EQ(poly->fn(), 1);
+        EXPECT_EQ(stats.allocations, 0);
+        enable_allocator_counters = true;
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(stats.allocations, 0);
+    EXPECT_EQ(stats.deallocations, 0);
+    EXPECT_EQ(new_call_counter, 0);
+    EXPECT_EQ(delete_call_counter, 0);
+}
+
+TEST(polymorphic_value, AllocatorBigObject)
+{
+    allocation_stats stats;
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    {
+        enable_allocator_counters = true;
+        counting_polymorphic_value<Base> poly{
+            std::allocator_arg, counting_allocator<char>{&stats}, in_place_type<DerivedBig>};
+        enable_allocator_counters = false;
+        EXPECT_EQ(poly->fn(), 2);
+        EXPECT_EQ(stats.allocations, 1);
+        EXPECT_EQ(stats.deallocations, 0);
+        EXPECT_TRUE(poly.get_allocator() == counting_allocator<char>{&stats});
+        enable_allocator_counters = true;
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(stats.allocations, 1);
+    EXPECT_EQ(stats.deallocations, 1);
+    EXPECT_EQ(new_call_counter, 0);
+    EXPECT_EQ(delete_call_counter, 0);
+}
+
+TEST(polymorphic_value, AllocatorCopyAndMoveConstructor)
+{
+    allocation_stats stats;
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        counting_polymorphic_value<Base> poly1{std::allocator_arg,
+                                               counting_allocator<char>{&stats},
+                                               in_place_type<DerivedBigSpecialFunctions>,
+                                               7};
+        counting_polymorphic_value<Base> poly2{poly1};
+        EXPECT_EQ(stats.allocations, 2);
+        EXPECT_TRUE(poly2.get_allocator() == counting_allocator<char>{&stats});
+
+        counting_polymorphic_value<Base> poly3{std::move(poly2)};
+        EXPECT_EQ(stats.allocations, 2);
+        EXPECT_EQ(poly3->fn(), 7);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+    }
+    EXPECT_EQ(stats.allocations, 2);
+    EXPECT_EQ(stats.deallocations, 2);
+    EXPECT_BIG_COUNTERS(0, 1, 1, 0, 0, 0, 2);
+}
+
+TEST(polymorphic_value, AllocatorMoveAssignmentWithUnequalAllocators)
+{
+    allocation_stats stats1;
+    allocation_stats stats2;
+    DerivedBigSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions2::reset_counters();
+    {
+        counting_polymorphic_value<Base> poly1{std::allocator_arg,
+                                               counting_allocator<char>{&stats1},
+                                               in_place_type<DerivedBigSpecialFunctions>,
+                                               7};
+        counting_polymorphic_value<Base> poly2{std::allocator_arg,
+                                               counting_allocator<char>{&stats2},
+                                               in_place_type<DerivedBigSpecialFunctions>,
+                                               8};
+
+        // Same type: the objects are move assigned, storage isn't exchanged
+        poly1 = std::move(poly2);
+        EXPECT_BIG_COUNTERS(0, 2, 0, 0, 0, 1, 0);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(stats1.allocations, 1);
+        EXPECT_EQ(stats2.allocations, 1);
+
+        // Different type: the object is moved into memory from the destination's
+        // allocator
+        counting_polymorphic_value<Base> poly3{std::allocator_arg,
+                                               counting_allocator<char>{&stats2},
+                                               in_place_type<DerivedBigSpecialFunctions2>,
+                                               9};
+        poly1 = std::move(poly3);
+        EXPECT_BIG_COUNTERS(0, 2, 0, 0, 0, 1, 1);
+        EXPECT_BIG2_COUNTERS(0, 1, 0, 1, 0, 0, 0);
+        EXPECT_EQ(poly1->fn(), 9);
+        EXPECT_EQ(stats1.allocations, 2);
+        EXPECT_EQ(stats1.deallocations, 1);
+        EXPECT_EQ(stats2.allocations, 2);
+        EXPECT_EQ(stats2.deallocations, 0);
+        EXPECT_TRUE(poly1.get_allocator() == counting_allocator<char>{&stats1});
+    }
+    EXPECT_EQ(stats1.allocations, 2);
+    EXPECT_EQ(stats1.deallocations, 2);
+    EXPECT_EQ(stats2.allocations, 2);
+    EXPECT_EQ(stats2.deallocations, 2);
+}
+
+#if POLYMORPHIC_VALUE_PMR_SUPPORTED
+TEST(polymorphic_value, PmrMonotonicBuffer)
+{
+    alignas(std::max_align_t) char buffer[1024];
+    std::pmr::monotonic_buffer_resource resource{
+        buffer, sizeof(buffer), std::pmr::null_memory_resource()};
+
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        enable_allocator_counters = true;
+        pmr::polymorphic_value<Base> poly1{
+            std::allocator_arg, &resource, in_place_type<DerivedBigSpecialFunctions>, 7};
+        pmr::polymorphic_value<Base> poly2{std::allocator_arg, &resource, poly1};
+        poly1.emplace<DerivedBigSpecialFunctions>(8);
+        enable_allocator_counters = false;
+
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        EXPECT_EQ(poly1.get_allocator().resource(), &resource);
+        EXPECT_EQ(poly2.get_allocator().resource(), &resource);
+        EXPECT_BIG_COUNTERS(0, 2, 1, 0, 0, 0, 1);
+        enable_allocator_counters = true;
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+    EXPECT_EQ(delete_call_counter, 0);
+    EXPECT_BIG_COUNTERS(0, 2, 1, 0, 0, 0, 3);
+}
+#endif
+
+using DerivedRelocatable = DerivedSpecialFunctions<3>;
+
+template<>
+struct pmv::is_trivially_relocatable<DerivedRelocatable> : std::true_type {
+};
+
+#define EXPECT_RELOCATABLE_COUNTERS(a, b, c, d, e, f, g)                                           \
+    DerivedRelocatable::expect_counters(a, b, c, d, e, f, g, __LINE__)
+
+TEST(polymorphic_value, RelocatableObjectMoveConstructor)
+{
+    DerivedRelocatable::reset_counters();
+    {
+        polymorphic_value<Base> poly1{in_place_type<DerivedRelocatable>, 7};
+        polymorphic_value<Base> poly2{std::move(poly1)};
+        EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_EQ(poly2->fn(), 7);
+    }
+    EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+TEST(polymorphic_value, RelocatableObjectMoveAssignment)
+{
+    DerivedRelocatable::reset_counters();
+    DerivedSmallSpecialFunctions::reset_counters();
+    {
+        polymorphic_value<Base> poly1{in_place_type<DerivedSmallSpecialFunctions>, 7};
+        polymorphic_value<Base> poly2{in_place_type<DerivedRelocatable>, 8};
+        poly1 = std::move(poly2);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+        EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_EQ(poly1->fn(), 8);
+
+        // A moved from value can be assigned again
+        poly2 = poly1;
+        EXPECT_RELOCATABLE_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_EQ(poly2->fn(), 8);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+    EXPECT_RELOCATABLE_COUNTERS(0, 1, 1, 0, 0, 0, 2);
+}
+
+TEST(polymorphic_value, RelocatableObjectVectorGrowth)
+{
+    DerivedRelocatable::reset_counters();
+    {
+        std::vector<polymorphic_value<Base>> values;
+        for (int i = 0; i < 100; ++i) {
+            values.emplace_back(in_place_type<DerivedRelocatable>, i);
+        }
+        EXPECT_RELOCATABLE_COUNTERS(0, 100, 0, 0, 0, 0, 0);
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(values[i]->fn(), i);
+        }
+    }
+    EXPECT_RELOCATABLE_COUNTERS(0, 100, 0, 0, 0, 0, 100);
+}
+
+TEST(polymorphic_value, BigObjectAssignmentAfterMove)
+{
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        enable_allocator_counters = true;
+        polymorphic_value<Base> poly1{in_place_type<DerivedBigSpecialFunctions>, 7};
+        polymorphic_value<Base> poly2{std::move(poly1)};
+        poly1 = DerivedBigSpecialFunctions{8};
+        enable_allocator_counters = false;
+        EXPECT_BIG_COUNTERS(0, 2, 0, 1, 0, 0, 1);
+        EXPECT_EQ(new_call_counter, 2);
+        EXPECT_EQ(delete_call_counter, 0);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        enable_allocator_counters = true;
+    }
+    enable_allocator_counters = false;
+    EXPECT_BIG_COUNTERS(0, 2, 0, 1, 0, 0, 3);
+    EXPECT_EQ(new_call_counter, 2);
+    EXPECT_EQ(delete_call_counter, 2);
+}
+
+struct alignas(32) DerivedOverAligned : public Base {
+    int fn() override { return 3; }
+};
+
+TEST(polymorphic_vector, EmplaceAndIterate)
+{
+    polymorphic_vector<Base> values;
+    values.emplace_back<DerivedSmall>();
+    values.emplace_back<DerivedBig>();
+    values.emplace_back<DerivedOverAligned>();
+    values.emplace_back<DerivedSmall>();
+    values.push_back(DerivedBig{});
+
+    ASSERT_EQ(values.size(), 5u);
+    EXPECT_EQ(values.type_count(), 3u);
+    EXPECT_EQ(values[0].fn(), 1);
+    EXPECT_EQ(values[1].fn(), 2);
+    EXPECT_EQ(values[2].fn(), 3);
+    EXPECT_EQ(values[3].fn(), 1);
+    EXPECT_EQ(values.back().fn(), 2);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&values[2]) % 32, 0u);
+
+    std::vector<int> visited;
+    for (auto& value : values) {
+        visited.push_back(value.fn());
+    }
+    EXPECT_EQ(visited, (std::vector<int>{1, 2, 3, 1, 2}));
+
+    visited.clear();
+    values.for_each_by_type([&](Base& value) { visited.push_back(value.fn()); });
+    EXPECT_EQ(visited, (std::vector<int>{1, 1, 2, 2, 3}));
+
+    int count = 0;
+    values.for_each_of_type<DerivedBig>([&](DerivedBig& value) { count += value.fn(); });
+    EXPECT_EQ(count, 4);
+
+    // Const access, the objects are passed as const
+    auto const& const_values = values;
+    std::size_t visits = 0;
+    const_values.for_each([&](auto& value) {
+        static_assert(std::is_same<decltype(value), Base const&>::value, "");
+        ++visits;
+    });
+    const_values.for_each_by_type([&](Base const&) { ++visits; });
+    const_values.for_each_of_type<DerivedBig>([&](auto& value) {
+        static_assert(std::is_same<decltype(value), DerivedBig const&>::value, "");
+        ++visits;
+    });
+    EXPECT_EQ(visits, 12u);
+}
+
+TEST(polymorphic_vector, PackedStorage)
+{
+    polymorphic_vector<Base> values;
+    for (int i = 0; i < 10; ++i) {
+        values.emplace_back<DerivedSmall>();
+    }
+    EXPECT_EQ(values.size_bytes(), sizeof(DerivedSmall) * 10);
+}
+
+TEST(polymorphic_vector, CapacityGrowsGeometrically)
+{
+    polymorphic_vector<Base> values;
+    std::size_t reallocations = 0;
+    std::size_t capacity = values.capacity();
+    for (int i = 0; i < 10000; ++i) {
+        values.emplace_back<DerivedSmall>();
+        EXPECT_GE(values.capacity(), values.size());
+        if (values.capacity() != capacity) {
+            EXPECT_GE(values.capacity(), 2 * capacity);
+            capacity = values.capacity();
+            ++reallocations;
+        }
+    }
+    EXPECT_LE(reallocations, 15u);
+}
+
+TEST(polymorphic_vector, GrowthMovesObjects)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedRelocatable::reset_counters();
+    {
+        polymorphic_vector<Base> values;
+        for (int i = 0; i < 100; ++i) {
+            values.emplace_back<DerivedRelocatable>(i);
+        }
+        EXPECT_RELOCATABLE_COUNTERS(0, 100, 0, 0, 0, 0, 0);
+
+        values.emplace_back<DerivedSmallSpecialFunctions>(100);
+        values.reserve_bytes(values.capacity_bytes() * 2);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 1, 0, 0, 1);
+        EXPECT_RELOCATABLE_COUNTERS(0, 100, 0, 0, 0, 0, 0);
+
+        for (int i = 0; i < 101; ++i) {
+            EXPECT_EQ(values[i].fn(), i);
+        }
+
+        values.pop_back();
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 1, 0, 0, 2);
+        EXPECT_EQ(values.size(), 100u);
+    }
+    EXPECT_RELOCATABLE_COUNTERS(0, 100, 0, 0, 0, 0, 100);
+}
+
+TEST(polymorphic_vector, CopyAndMove)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        polymorphic_vector<Base> values1;
+        values1.reserve_bytes(256);
+        values1.emplace_back<DerivedSmallSpecialFunctions>(7);
+        values1.emplace_back<DerivedBigSpecialFunctions>(8);
+
+        polymorphic_vector<Base> values2{values1};
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_EQ(values2[0].fn(), 7);
+        EXPECT_EQ(values2[1].fn(), 8);
+
+        polymorphic_vector<Base> values3{std::move(values1)};
+        EXPECT_TRUE(values1.empty());
+        EXPECT_EQ(values3.size(), 2u);
+
+        values3 = values2;
+        EXPECT_SMALL_COUNTERS(0, 1, 2, 0, 0, 0, 1);
+        EXPECT_BIG_COUNTERS(0, 1, 2, 0, 0, 0, 1);
+
+        values2.clear();
+        EXPECT_SMALL_COUNTERS(0, 1, 2, 0, 0, 0, 2);
+        EXPECT_TRUE(values2.empty());
+        EXPECT_EQ(values3[1].fn(), 8);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 2, 0, 0, 0, 3);
+    EXPECT_BIG_COUNTERS(0, 1, 2, 0, 0, 0, 3);
+}
+
+TEST(polymorphic_value, VtableFitsInCacheLine)
+{
+    // Heap vtables are preceded by a pointer to tell them apart from local ones
+    EXPECT_LE(sizeof(detail::polymorphic_value_vtable) + sizeof(void*), 64u);
+    EXPECT_EQ(offsetof(detail::polymorphic_value_vtable, destroy), 0u);
+    EXPECT_EQ(offsetof(detail::polymorphic_value_vtable, move), sizeof(void*));
+}
+
+TEST(polymorphic_value, VtablesAreConstants)
+{
+    using storage_t = detail::sbo_storage<sizeof(void*) * 3, alignof(void*), std::allocator<char>>;
+    using local_vtable = detail::get_vtable<DerivedSmall, storage_t>;
+    using heap_vtable = detail::get_vtable<DerivedBig, storage_t>;
+
+    // The addresses are known at compile time, without a call or a guard
+    constexpr auto* local = local_vtable::get();
+    constexpr auto* heap = heap_vtable::get();
+    constexpr auto* moved_from = detail::get_moved_from_vtable();
+    EXPECT_NE(local, heap);
+    EXPECT_NE(local, moved_from);
+
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(local) % detail::vtable_alignment, 0u);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(heap) % detail::vtable_alignment, sizeof(void*));
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(moved_from) % detail::vtable_alignment, 0u);
+    EXPECT_EQ(local->info->heap_vtable, (detail::get_vtable<DerivedSmall, storage_t, true>::get()));
+    EXPECT_EQ(heap->info->heap_vtable, heap);
+}
+
+struct DerivedFinal final : public Base {
+    int fn() override { return 5; }
+};
+
+struct DerivedFromSmall : public DerivedSmall {
+    int fn() override { return 6; }
+};
+
+TEST(polymorphic_value, SlicingCheck)
+{
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    DerivedFromSmall derived;
+    DerivedSmall& sliced = derived;
+    EXPECT_THROW(polymorphic_value<Base>{sliced}, bad_polymorphic_value);
+
+    polymorphic_value<Base> poly{in_place_type<DerivedSmall>};
+    EXPECT_THROW(poly = sliced, bad_polymorphic_value);
+    EXPECT_THROW(poly = std::move(sliced), bad_polymorphic_value);
+#endif
+}
+
+TEST(polymorphic_value, FinalTypesAreNotChecked)
+{
+    static_assert(std::is_nothrow_constructible<polymorphic_value<Base>, DerivedFinal&&>::value,
+                  "Final types can't slice");
+    static_assert(std::is_nothrow_constructible<polymorphic_value<Base>,
+                                                unchecked_t,
+                                                DerivedSmall const&>::value,
+                  "Unchecked construction can't throw");
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    static_assert(!std::is_nothrow_constructible<polymorphic_value<Base>, DerivedSmall&&>::value,
+                  "Non final types are checked");
+#endif
+
+    polymorphic_value<Base> poly{DerivedFinal{}};
+    EXPECT_EQ(poly->fn(), 5);
+    poly = DerivedSmall{};
+    EXPECT_EQ(poly->fn(), 1);
+    poly = DerivedFinal{};
+    EXPECT_EQ(poly->fn(), 5);
+}
+
+TEST(polymorphic_value, UncheckedConstructionAndAssignment)
+{
+    DerivedSmall small;
+    polymorphic_value<Base> poly{unchecked, small};
+    EXPECT_EQ(poly->fn(), 1);
+
+    poly.assign(unchecked, DerivedBig{});
+    EXPECT_EQ(poly->fn(), 2);
+
+    poly.assign(unchecked, small);
+    EXPECT_EQ(poly->fn(), 1);
+
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    DerivedFromSmall derived;
+    DerivedSmall& sliced = derived;
+    EXPECT_DEBUG_DEATH(poly.assign(unchecked, sliced), "");
+#endif
+}
+
+template<typename Base>
+using cached_polymorphic_value = polymorphic_value<Base,
+                                                   true,
+                                                   sizeof(void*) * 3,
+                                                   alignof(void*),
+                                                   std::allocator<char>,
+                                                   cached_pointer_policy>;
+
+TEST(polymorphic_value, CachedPointerSize)
+{
+    EXPECT_EQ(sizeof(cached_polymorphic_value<Base>),
+              sizeof(polymorphic_value<Base>) + sizeof(void*));
+}
+
+TEST(polymorphic_value, CachedPointerFollowsObject)
+{
+    cached_polymorphic_value<Base> small{in_place_type<DerivedSmallSpecialFunctions>, 7};
+    cached_polymorphic_value<Base> big{in_place_type<DerivedBigSpecialFunctions>, 8};
+    EXPECT_EQ(small->fn(), 7);
+    EXPECT_EQ(big->fn(), 8);
+
+    cached_polymorphic_value<Base> copy{small};
+    EXPECT_EQ(copy->fn(), 7);
+    EXPECT_NE(&*copy, &*small);
+
+    cached_polymorphic_value<Base> moved{std::move(copy)};
+    EXPECT_EQ(moved->fn(), 7);
+
+    copy = big;
+    EXPECT_EQ(copy->fn(), 8);
+
+    cached_polymorphic_value<Base> big2{in_place_type<DerivedBigSpecialFunctions>, 9};
+    copy = std::move(big2);
+    EXPECT_EQ(copy->fn(), 9);
+    EXPECT_EQ(big2->fn(), 8);
+
+    copy.emplace<DerivedRelocatable>(10);
+    EXPECT_EQ(copy->fn(), 10);
+
+    moved = std::move(copy);
+    EXPECT_EQ(moved->fn(), 10);
+
+    moved = DerivedBigSpecialFunctions{11};
+    EXPECT_EQ(moved->fn(), 11);
+
+    std::vector<cached_polymorphic_value<Base>> values;
+    for (int i = 0; i < 20; ++i) {
+        values.emplace_back(in_place_type<DerivedSmallSpecialFunctions>, i);
+    }
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(values[i]->fn(), i);
+    }
+}
+
+template<typename Base_>
+using cow_polymorphic_value = polymorphic_value<Base_,
+                                                true,
+                                                sizeof(void*) * 3,
+                                                alignof(void*),
+                                                std::allocator<char>,
+                                                copy_on_write_policy>;
+
+TEST(polymorphic_value, CopyOnWriteSharesHeapObjects)
+{
+    DerivedBigSpecialFunctions::reset_counters();
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        cow_polymorphic_value<Base> const value{in_place_type<DerivedBigSpecialFunctions>, 5};
+        EXPECT_EQ(new_call_counter, 1);
+
+        cow_polymorphic_value<Base> copy1{value};
+        cow_polymorphic_value<Base> copy2{in_place_type<DerivedSmall>};
+        copy2 = copy1;
+        EXPECT_EQ(new_call_counter, 1);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_EQ(&*value, &*static_cast<cow_polymorphic_value<Base> const&>(copy1));
+
+        // Non const access copies the shared object
+        EXPECT_EQ(copy1->fn(), 5);
+        EXPECT_EQ(new_call_counter, 2);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_NE(&*value, &*static_cast<cow_polymorphic_value<Base> const&>(copy1));
+
+        // Now it is the only owner, so it isn't copied again
+        EXPECT_EQ((*copy1).fn(), 5);
+        EXPECT_EQ(new_call_counter, 2);
+
+        // Assigning into a shared object replaces it
+        copy2 = DerivedBigSpecialFunctions{6};
+        EXPECT_EQ(new_call_counter, 3);
+        EXPECT_BIG_COUNTERS(0, 2, 1, 1, 0, 0, 1);
+        EXPECT_EQ(copy2->fn(), 6);
+        EXPECT_EQ(static_cast<DerivedBigSpecialFunctions const&>(*value).value, 5);
+
+        // Moves steal the reference
+        cow_polymorphic_value<Base> moved{std::move(copy2)};
+        EXPECT_EQ(new_call_counter, 3);
+        EXPECT_EQ(moved->fn(), 6);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(delete_call_counter, 3);
+    EXPECT_BIG_COUNTERS(0, 2, 1, 1, 0, 0, 4);
+}
+
+TEST(polymorphic_value, CopyOnWriteLocalObjectsAreCopied)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    {
+        cow_polymorphic_value<Base> value{in_place_type<DerivedSmallSpecialFunctions>, 5};
+        cow_polymorphic_value<Base> copy{value};
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        copy = value;
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 1, 0, 0);
+        EXPECT_EQ(copy->fn(), 5);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 1, 0, 2);
+}
+
+TEST(polymorphic_value, CopyOnWriteUnequalAllocators)
+{
+    allocation_stats stats1;
+    allocation_stats stats2;
+    using value_t = polymorphic_value<Base,
+                                      true,
+                                      sizeof(void*) * 3,
+                                      alignof(void*),
+                                      counting_allocator<char>,
+                                      copy_on_write_policy>;
+    {
+        value_t value{std::allocator_arg, counting_allocator<char>{&stats1}, DerivedBig{}};
+        value_t same{std::allocator_arg, counting_allocator<char>{&stats1}, value};
+        value_t other{std::allocator_arg, counting_allocator<char>{&stats2}, value};
+        EXPECT_EQ(stats1.allocations, 1);
+        EXPECT_EQ(stats2.allocations, 1);
+
+        other = std::move(same);
+        EXPECT_EQ(stats2.allocations, 2);
+        EXPECT_EQ(stats1.allocations, 1);
+    }
+    EXPECT_EQ(stats1.deallocations, 1);
+    EXPECT_EQ(stats2.deallocations, 2);
+}
+
+template<typename Base_>
+using large_polymorphic_value = polymorphic_value<Base_, true, sizeof(void*) * 8>;
+
+TEST(polymorphic_value, ConversionBetweenSboSizes)
+{
+    DerivedBigSpecialFunctions::reset_counters();
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        // The object is local in the large value but doesn't fit in the small one
+        large_polymorphic_value<Base> large{in_place_type<DerivedBigSpecialFunctions>, 5};
+        polymorphic_value<Base> small{std::move(large)};
+        EXPECT_EQ(new_call_counter, 1);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 1, 0, 0, 0);
+        EXPECT_EQ(small->fn(), 5);
+
+        // Heap objects are stolen
+        large_polymorphic_value<Base> stolen{std::move(small)};
+        EXPECT_EQ(new_call_counter, 1);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 1, 0, 0, 0);
+        EXPECT_EQ(stolen->fn(), 5);
+
+        polymorphic_value<Base> copy{stolen};
+        EXPECT_EQ(new_call_counter, 2);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 0);
+        EXPECT_EQ(copy->fn(), 5);
+
+        large = std::move(copy);
+        EXPECT_EQ(new_call_counter, 2);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 1);
+        EXPECT_EQ(large->fn(), 5);
+
+        copy = large;
+        EXPECT_EQ(new_call_counter, 3);
+        EXPECT_EQ(copy->fn(), 5);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(delete_call_counter, 3);
+    EXPECT_BIG_COUNTERS(0, 1, 2, 1, 0, 0, 4);
+}
+
+TEST(polymorphic_value, ConversionOfFittingObjects)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedRelocatable::reset_counters();
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        large_polymorphic_value<Base> large{in_place_type<DerivedSmallSpecialFunctions>, 5};
+        polymorphic_value<Base> small{std::move(large)};
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 1, 0, 0, 0);
+        EXPECT_EQ(small->fn(), 5);
+
+        polymorphic_value<Base, false> no_alloc{in_place_type<DerivedRelocatable>, 6};
+        large_polymorphic_value<Base> relocated{std::move(no_alloc)};
+        EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_EQ(relocated->fn(), 6);
+
+        large_polymorphic_value<Base> copy{small};
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 1, 0, 0, 0);
+        EXPECT_EQ(copy->fn(), 5);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+    EXPECT_SMALL_COUNTERS(0, 1, 1, 1, 0, 0, 3);
+    EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+TEST(polymorphic_value, ConversionWithAllocator)
+{
+    allocation_stats stats;
+    using large_t = polymorphic_value<Base,
+                                      true,
+                                      sizeof(void*) * 8,
+                                      alignof(void*),
+                                      counting_allocator<char>>;
+    {
+        counting_polymorphic_value<Base> value{
+            std::allocator_arg, counting_allocator<char>{&stats}, DerivedBig{}};
+        large_t large{std::move(value)};
+        EXPECT_EQ(large.get_allocator(), counting_allocator<char>{&stats});
+        EXPECT_EQ(large->fn(), 2);
+
+        counting_polymorphic_value<Base> copy{large};
+        EXPECT_EQ(copy->fn(), 2);
+    }
+    EXPECT_EQ(stats.allocations, 2);
+    EXPECT_EQ(stats.deallocations, 2);
+}
+
+// Uninitialized storage for N values
+template<typename Value, std::size_t N>
+struct value_buffer {
+    Value* data() noexcept { return reinterpret_cast<Value*>(bytes); }
+    Value& operator[](std::size_t i) noexcept { return data()[i]; }
+
+    alignas(Value) unsigned char bytes[sizeof(Value) * N];
+};
+
+template<typename Value>
+std::vector<Value> make_mixed_values()
+{
+    std::vector<Value> values;
+    for (int i = 0; i < 3; ++i) {
+        values.emplace_back(in_place_type<DerivedSmallSpecialFunctions>, i);
+    }
+    values.emplace_back(in_place_type<DerivedRelocatable>, 3);
+    values.emplace_back(in_place_type<DerivedRelocatable>, 4);
+    for (int i = 5; i < 7; ++i) {
+        values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, i);
+    }
+    values.emplace_back(in_place_type<DerivedSmallSpecialFunctions>, 7);
+    return values;
+}
+
+template<typename Value>
+void test_bulk_operations()
+{
+    auto values = make_mixed_values<Value>();
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedRelocatable::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+
+    value_buffer<Value, 8> copies;
+    EXPECT_EQ(pmv::uninitialized_copy_n(values.data(), values.size(), copies.data()),
+              copies.data() + 8);
+    EXPECT_SMALL_COUNTERS(0, 0, 4, 0, 0, 0, 0);
+    EXPECT_RELOCATABLE_COUNTERS(0, 0, 2, 0, 0, 0, 0);
+    EXPECT_BIG_COUNTERS(0, 0, 2, 0, 0, 0, 0);
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_EQ(copies[i]->fn(), i);
+    }
+
+    // Objects that aren't trivially relocatable are moved, heap objects are stolen
+    value_buffer<Value, 8> relocated;
+    pmv::uninitialized_relocate_n(copies.data(), 8, relocated.data());
+    EXPECT_SMALL_COUNTERS(0, 0, 4, 4, 0, 0, 4);
+    EXPECT_RELOCATABLE_COUNTERS(0, 0, 2, 0, 0, 0, 0);
+    EXPECT_BIG_COUNTERS(0, 0, 2, 0, 0, 0, 0);
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_EQ(relocated[i]->fn(), i);
+    }
+
+    pmv::destroy_n(relocated.data(), 8);
+    EXPECT_SMALL_COUNTERS(0, 0, 4, 4, 0, 0, 8);
+    EXPECT_RELOCATABLE_COUNTERS(0, 0, 2, 0, 0, 0, 2);
+    EXPECT_BIG_COUNTERS(0, 0, 2, 0, 0, 0, 2);
+}
+
+TEST(polymorphic_value, BulkOperations)
+{
+    test_bulk_operations<polymorphic_value<Base>>();
+}
+
+TEST(polymorphic_value, BulkOperationsWithCachedPointer)
+{
+    test_bulk_operations<cached_polymorphic_value<Base>>();
+}
+
+TEST(polymorphic_value, BulkOperationsWithCopyOnWrite)
+{
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        std::vector<cow_polymorphic_value<Base>> values;
+        values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, 1);
+        values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, 2);
+
+        value_buffer<cow_polymorphic_value<Base>, 2> copies;
+        pmv::uninitialized_copy_n(values.data(), 2, copies.data());
+        EXPECT_BIG_COUNTERS(0, 2, 0, 0, 0, 0, 0);
+        EXPECT_EQ(&*std::as_const(copies[1]), &*std::as_const(values[1]));
+
+        pmv::destroy_n(copies.data(), 2);
+        EXPECT_BIG_COUNTERS(0, 2, 0, 0, 0, 0, 0);
+    }
+    EXPECT_BIG_COUNTERS(0, 2, 0, 0, 0, 0, 2);
+}
+
+struct DerivedThrowingCopy : public Base {
+    static int copies_left;
+
+    DerivedThrowingCopy() = default;
+    DerivedThrowingCopy(DerivedThrowingCopy const&)
+    {
+        if (copies_left == 0) {
+            throw std::runtime_error{"copy"};
+        }
+        --copies_left;
+    }
+    DerivedThrowingCopy(DerivedThrowingCopy&&) noexcept = default;
+    DerivedThrowingCopy& operator=(DerivedThrowingCopy const&) = default;
+
+    int fn() override { return 3; }
+};
+
+int DerivedThrowingCopy::copies_left = 0;
+
+TEST(polymorphic_value, BulkCopyThrows)
+{
+    auto values = make_mixed_values<polymorphic_value<Base>>();
+    values.emplace_back(in_place_type<DerivedThrowingCopy>);
+    values.emplace_back(in_place_type<DerivedThrowingCopy>);
+    values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, 10);
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+
+    DerivedThrowingCopy::copies_left = 1;
+    value_buffer<polymorphic_value<Base>, 11> copies;
+    EXPECT_THROW(pmv::uninitialized_copy_n(values.data(), values.size(), copies.data()),
+                 std::runtime_error);
+
+    // Everything copied before the exception is destroyed
+    EXPECT_SMALL_COUNTERS(0, 0, 4, 0, 0, 0, 4);
+    EXPECT_BIG_COUNTERS(0, 0, 2, 0, 0, 0, 2);
+}
+
+struct DerivedThrowingMove : public Base {
+    DerivedThrowingMove() = default;
+    DerivedThrowingMove(DerivedThrowingMove&&) noexcept(false) {}
+
+    int fn() override { return 5; }
+};
+
+TEST(polymorphic_value, HeapStorageReasons)
+{
+    using reasons_big = heap_storage_reasons<polymorphic_value<Base>, DerivedBig>;
+    static_assert(reasons_big::too_large && !reasons_big::over_aligned
+                      && !reasons_big::throwing_move && reasons_big::stored_in_heap,
+                  "");
+
+    using reasons_aligned = heap_storage_reasons<polymorphic_value<Base>, DerivedOverAligned>;
+    static_assert(reasons_aligned::over_aligned && !reasons_aligned::throwing_move, "");
+
+    using reasons_throwing = heap_storage_reasons<polymorphic_value<Base>, DerivedThrowingMove>;
+    static_assert(!reasons_throwing::too_large && !reasons_throwing::over_aligned
+                      && reasons_throwing::throwing_move,
+                  "");
+
+    using reasons_small = heap_storage_reasons<polymorphic_value<Base>, DerivedSmall>;
+    static_assert(!reasons_small::stored_in_heap, "");
+    static_assert(assert_stored_locally<polymorphic_value<Base>, DerivedSmall, DerivedRelocatable>,
+                  "");
+}
+
+TEST(polymorphic_value, PolymorphicValueFor)
+{
+    using value_t = polymorphic_value_for<Base, DerivedSmall, DerivedBig, DerivedOverAligned>;
+    // The size of DerivedBig, rounded up to the alignment of DerivedOverAligned
+    static_assert(value_t::sbo_size == 2 * alignof(DerivedOverAligned), "");
+    static_assert(value_t::sbo_alignment == alignof(DerivedOverAligned), "");
+    static_assert(assert_stored_locally<value_t, DerivedSmall, DerivedBig, DerivedOverAligned>,
+                  "");
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        value_t small{DerivedSmall{}};
+        value_t big{DerivedBig{}};
+        value_t aligned{DerivedOverAligned{}};
+        EXPECT_EQ(small->fn() + big->fn() + aligned->fn(), 6);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+using closed_value_t = closed_polymorphic_value<Base,
+                                                DerivedSmallSpecialFunctions,
+                                                DerivedBigSpecialFunctions,
+                                                DerivedSmall>;
+
+TEST(closed_polymorphic_value, Storage)
+{
+    static_assert(closed_value_t::sbo_size == sizeof(DerivedBigSpecialFunctions), "");
+    static_assert(sizeof(closed_value_t) == sizeof(DerivedBigSpecialFunctions) + alignof(void*),
+                  "");
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        closed_value_t small{in_place_type<DerivedSmall>};
+        closed_value_t big{DerivedBigSpecialFunctions{7}};
+        EXPECT_EQ(small->fn(), 1);
+        EXPECT_EQ(big->fn(), 7);
+        EXPECT_EQ(small.index(), 2u);
+        EXPECT_TRUE(big.holds<DerivedBigSpecialFunctions>());
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+TEST(closed_polymorphic_value, CopyMoveAndAssignment)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        closed_value_t small{in_place_type<DerivedSmallSpecialFunctions>, 1};
+        closed_value_t big{in_place_type<DerivedBigSpecialFunctions>, 2};
+
+        closed_value_t copy{small};
+        closed_value_t moved{std::move(big)};
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 1, 0, 0, 0);
+        EXPECT_EQ(copy->fn(), 1);
+        EXPECT_EQ(moved->fn(), 2);
+
+        // Same type
+        copy = small;
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 1, 0, 0);
+
+        // Cross type
+        copy = moved;
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 1, 0, 1);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 0);
+        EXPECT_EQ(copy->fn(), 2);
+
+        copy = DerivedSmallSpecialFunctions{3};
+        EXPECT_SMALL_COUNTERS(0, 2, 1, 1, 1, 0, 2);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 1);
+        EXPECT_EQ(copy->fn(), 3);
+
+        copy.emplace<DerivedSmall>();
+        EXPECT_SMALL_COUNTERS(0, 2, 1, 1, 1, 0, 3);
+        EXPECT_EQ(copy->fn(), 1);
+    }
+    EXPECT_SMALL_COUNTERS(0, 2, 1, 1, 1, 0, 4);
+    EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 3);
+}
+
+TEST(closed_polymorphic_value, Visit)
+{
+    closed_value_t value{in_place_type<DerivedBigSpecialFunctions>, 5};
+    auto const size = value.visit([](auto& d) { return sizeof(d); });
+    EXPECT_EQ(size, sizeof(DerivedBigSpecialFunctions));
+
+    value.visit([](auto& d) { d = std::decay_t<decltype(d)>{}; });
+    EXPECT_EQ(value->fn(), static_cast<int>(sizeof(void*) * 4 + 3));
+
+    closed_value_t const& const_value = value;
+    EXPECT_TRUE(const_value.visit([](auto const& d) {
+        return std::is_same<std::decay_t<decltype(d)>, DerivedBigSpecialFunctions>::value;
+    }));
+}
+
+template<typename Base_>
+using move_only_polymorphic_value = polymorphic_value<Base_,
+                                                      true,
+                                                      sizeof(void*) * 3,
+                                                      alignof(void*),
+                                                      std::allocator<char>,
+                                                      move_only_policy>;
+
+// Like a file handle
+struct DerivedMoveOnly : public Base {
+    explicit DerivedMoveOnly(int v) noexcept : value{v} {}
+    DerivedMoveOnly(DerivedMoveOnly&& o) noexcept : value{o.value} { o.value = -1; }
+    DerivedMoveOnly(DerivedMoveOnly const&) = delete;
+    DerivedMoveOnly& operator=(DerivedMoveOnly&&) = default;
+    DerivedMoveOnly& operator=(DerivedMoveOnly const&) = delete;
+
+    int fn() override { return value; }
+
+    int value;
+};
+
+struct DerivedBigMoveOnly : public DerivedMoveOnly {
+    using DerivedMoveOnly::DerivedMoveOnly;
+
+    char data[sizeof(void*) * 4] = {};
+};
+
+TEST(polymorphic_value, MoveOnly)
+{
+    using value_t = move_only_polymorphic_value<Base>;
+    static_assert(!std::is_copy_constructible<value_t>::value, "");
+    static_assert(!std::is_copy_assignable<value_t>::value, "");
+    static_assert(std::is_nothrow_move_constructible<value_t>::value, "");
+    static_assert(std::is_nothrow_move_assignable<value_t>::value, "");
+    static_assert(std::is_copy_constructible<polymorphic_value<Base>>::value, "");
+
+    value_t small{in_place_type<DerivedMoveOnly>, 1};
+    value_t big{in_place_type<DerivedBigMoveOnly>, 2};
+    EXPECT_EQ(small->fn(), 1);
+    EXPECT_EQ(big->fn(), 2);
+
+    value_t moved{std::move(small)};
+    EXPECT_EQ(moved->fn(), 1);
+    small = std::move(big);
+    EXPECT_EQ(small->fn(), 2);
+    small = DerivedMoveOnly{3};
+    EXPECT_EQ(small->fn(), 3);
+    small.emplace<DerivedBigMoveOnly>(4);
+    EXPECT_EQ(small->fn(), 4);
+
+    // Moves between SBO sizes are still allowed
+    using large_value_t = polymorphic_value<Base,
+                                            true,
+                                            sizeof(void*) * 8,
+                                            alignof(void*),
+                                            std::allocator<char>,
+                                            move_only_policy>;
+    static_assert(!std::is_constructible<large_value_t, value_t const&>::value, "");
+    large_value_t large{std::move(small)};
+    EXPECT_EQ(large->fn(), 4);
+
+    std::vector<value_t> values;
+    for (int i = 0; i < 20; ++i) {
+        values.emplace_back(in_place_type<DerivedMoveOnly>, i);
+    }
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(values[i]->fn(), i);
+    }
+}
+
+template<typename Base_>
+using recycling_polymorphic_value = polymorphic_value<Base_,
+                                                      true,
+                                                      sizeof(void*) * 3,
+                                                      alignof(void*),
+                                                      recycling_allocator<char>>;
+
+TEST(recycling_allocator, EmplaceReusesBlocks)
+{
+    recycling_polymorphic_value<Base> value{in_place_type<DerivedBigSpecialFunctions>, 1};
+    value.emplace<DerivedBigSpecialFunctions2>(2);
+
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    enable_allocator_counters = true;
+    for (int i = 0; i < 100; ++i) {
+        value.emplace<DerivedBigSpecialFunctions>(i);
+        value = DerivedBigSpecialFunctions2{i};
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+    EXPECT_EQ(delete_call_counter, 0);
+    EXPECT_EQ(value->fn(), 99);
+
+    // Local objects and large blocks don't go through the cache
+    value.emplace<DerivedSmall>();
+    EXPECT_EQ(value->fn(), 1);
+    value.emplace<DerivedSpecialFunctions<2048>>(3);
+    EXPECT_EQ(value->fn(), 3);
+    value.emplace<DerivedOverAligned>();
+    EXPECT_EQ(value->fn(), 3);
+}
+
+TEST(recycling_allocator, BlocksFreedByOtherThreads)
+{
+    std::vector<recycling_polymorphic_value<Base>> values;
+    for (int i = 0; i < 100; ++i) {
+        values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, i);
+    }
+
+    // Freed blocks go to the cache of the thread freeing them, and are
+    // released when it exits
+    std::thread{[&] {
+        values.clear();
+        recycling_polymorphic_value<Base> value{in_place_type<DerivedBigSpecialFunctions>, 1};
+        EXPECT_EQ(value->fn(), 1);
+    }}.join();
+    EXPECT_TRUE(values.empty());
+
+    recycling_allocator<int> a;
+    recycling_allocator<char> b{a};
+    EXPECT_TRUE(a == b);
+    EXPECT_FALSE(a != b);
+}
+
+template<typename Base_>
+using slab_polymorphic_value = polymorphic_value<Base_,
+                                                 true,
+                                                 sizeof(void*) * 3,
+                                                 alignof(void*),
+                                                 slab_allocator<char>>;
+
+// Only allocated by the slab_allocator tests, so its pool starts empty
+struct DerivedSlab : public Base {
+    explicit DerivedSlab(int i) : value{i} {}
+    int fn() override { return value; }
+
+    int value;
+    char data[sizeof(void*) * 4] = {};
+};
+
+TEST(slab_allocator, ObjectsAreContiguous)
+{
+    std::vector<slab_polymorphic_value<Base>> values;
+    values.reserve(100);
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    for (int i = 0; i < 100; ++i) {
+        values.emplace_back(in_place_type<DerivedSlab>, i);
+    }
+    enable_allocator_counters = false;
+    // The pool and a slab holding all the objects
+    EXPECT_LE(new_call_counter, 2);
+
+    auto const address = [&](std::size_t i) { return reinterpret_cast<char*>(&*values[i]); };
+    for (std::size_t i = 1; i < values.size(); ++i) {
+        EXPECT_EQ(address(i) - address(i - 1), static_cast<std::ptrdiff_t>(sizeof(DerivedSlab)));
+        EXPECT_EQ(values[i]->fn(), static_cast<int>(i));
+    }
+
+    // The last freed block is reused first
+    auto* const freed = address(10);
+    values[10].emplace<DerivedSmall>();
+    slab_polymorphic_value<Base> reused{in_place_type<DerivedSlab>, 100};
+    EXPECT_EQ(reinterpret_cast<char*>(&*reused), freed);
+    EXPECT_EQ(reused->fn(), 100);
+
+    // Copies take blocks from the same slabs
+    auto copy = values;
+    EXPECT_EQ(copy[30]->fn(), 30);
+    EXPECT_EQ(reinterpret_cast<char*>(&*copy[31]) - reinterpret_cast<char*>(&*copy[30]),
+              static_cast<std::ptrdiff_t>(sizeof(DerivedSlab)));
+}
+
+TEST(slab_allocator, FallbackAndThreads)
+{
+    // Large and over aligned objects don't come from slabs
+    slab_polymorphic_value<Base> value{in_place_type<DerivedSpecialFunctions<2048>>, 3};
+    EXPECT_EQ(value->fn(), 3);
+    value.emplace<DerivedOverAligned>();
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&*value) % alignof(DerivedOverAligned), 0u);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t] {
+            std::vector<slab_polymorphic_value<Base>> values;
+            for (int i = 0; i < 1000; ++i) {
+                values.emplace_back(in_place_type<DerivedSlab>, t * 1000 + i);
+            }
+            for (int i = 0; i < 1000; ++i) {
+                EXPECT_EQ(values[i]->fn(), t * 1000 + i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    slab_allocator<int> a;
+    slab_allocator<char> b{a};
+    EXPECT_TRUE(a == b);
+    EXPECT_FALSE(a != b);
+}
+
+struct DerivedBigThrowingCopy : public DerivedThrowingCopy {
+    int fn() override { return 6; }
+
+    char data[sizeof(void*) * 4] = {};
+};
+
+TEST(polymorphic_value, ThrowingCrossTypeCopyLeavesValueMovedFrom)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    {
+        polymorphic_value<Base> value{in_place_type<DerivedSmallSpecialFunctions>, 1};
+        polymorphic_value<Base> const throwing{in_place_type<DerivedThrowingCopy>};
+
+        DerivedThrowingCopy::copies_left = 0;
+        EXPECT_THROW(value = throwing, std::runtime_error);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+
+        // The value can be assigned again
+        value = polymorphic_value<Base>{DerivedSmall{}};
+        EXPECT_EQ(value->fn(), 1);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+template<typename Base_>
+using strong_polymorphic_value = polymorphic_value<Base_,
+                                                   true,
+                                                   sizeof(void*) * 3,
+                                                   alignof(void*),
+                                                   std::allocator<char>,
+                                                   strong_exception_safety_policy>;
+
+TEST(polymorphic_value, StrongExceptionSafety)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        strong_polymorphic_value<Base> small{in_place_type<DerivedSmallSpecialFunctions>, 1};
+        strong_polymorphic_value<Base> big{in_place_type<DerivedBigSpecialFunctions>, 2};
+        strong_polymorphic_value<Base> const throwing{in_place_type<DerivedThrowingCopy>};
+        strong_polymorphic_value<Base> const big_throwing{in_place_type<DerivedBigThrowingCopy>};
+        DerivedThrowingCopy const object;
+
+        DerivedThrowingCopy::copies_left = 0;
+        EXPECT_THROW(small = throwing, std::runtime_error);
+        EXPECT_THROW(big = big_throwing, std::runtime_error);
+        EXPECT_THROW(small = object, std::runtime_error);
+        EXPECT_THROW(big.emplace<DerivedThrowingCopy>(object), std::runtime_error);
+        EXPECT_EQ(small->fn(), 1);
+        EXPECT_EQ(big->fn(), 2);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+
+        // Local objects are built on the stack, without allocating
+        DerivedThrowingCopy::copies_left = 1;
+        new_call_counter = 0;
+        enable_allocator_counters = true;
+        small = throwing;
+        enable_allocator_counters = false;
+        EXPECT_EQ(new_call_counter, 0);
+        EXPECT_EQ(small->fn(), 3);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+
+        DerivedThrowingCopy::copies_left = 1;
+        big = big_throwing;
+        EXPECT_EQ(big->fn(), 6);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+
+        // Objects that can't throw are built in place
+        small.emplace<DerivedSmallSpecialFunctions>(4);
+        EXPECT_EQ(small->fn(), 4);
+        EXPECT_SMALL_COUNTERS(0, 2, 0, 0, 0, 0, 1);
+    }
+    EXPECT_SMALL_COUNTERS(0, 2, 0, 0, 0, 0, 2);
+}
+
+TEST(polymorphic_value, SwapHeapObjects)
+{
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    DerivedBigSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions2::reset_counters();
+    {
+        polymorphic_value<Base> poly1{in_place_type<DerivedBigSpecialFunctions>, 7};
+        polymorphic_value<Base> poly2{in_place_type<DerivedBigSpecialFunctions2>, 8};
+        enable_allocator_counters = true;
+        swap(poly1, poly2);
+        enable_allocator_counters = false;
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        EXPECT_EQ(new_call_counter, 0);
+        EXPECT_EQ(delete_call_counter, 0);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+        EXPECT_BIG2_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+    }
+    EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+    EXPECT_BIG2_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+TEST(polymorphic_value, SwapLocalAndHeapObjects)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        polymorphic_value<Base> poly1{in_place_type<DerivedSmallSpecialFunctions>, 7};
+        polymorphic_value<Base> poly2{in_place_type<DerivedBigSpecialFunctions>, 8};
+        poly1.swap(poly2);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        // The local object goes through a stack buffer, the heap one isn't moved
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 2, 0, 0, 2);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+
+        poly1.swap(poly2);
+        EXPECT_EQ(poly1->fn(), 7);
+        EXPECT_EQ(poly2->fn(), 8);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 3, 0, 0, 3);
+        EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 0, 3, 0, 0, 4);
+    EXPECT_BIG_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+TEST(polymorphic_value, SwapLocalObjects)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedSmallSpecialFunctions2::reset_counters();
+    DerivedRelocatable::reset_counters();
+    {
+        polymorphic_value<Base> poly1{in_place_type<DerivedSmallSpecialFunctions>, 7};
+        polymorphic_value<Base> poly2{in_place_type<DerivedSmallSpecialFunctions2>, 8};
+        swap(poly1, poly2);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        EXPECT_SMALL_COUNTERS(0, 1, 0, 2, 0, 0, 2);
+        EXPECT_SMALL2_COUNTERS(0, 1, 0, 1, 0, 0, 1);
+
+        // Heap and trivially relocatable objects are swapped as bytes
+        polymorphic_value<Base> poly3{in_place_type<DerivedRelocatable>, 9};
+        polymorphic_value<Base> poly4{DerivedBig{}};
+        swap(poly3, poly4);
+        EXPECT_EQ(poly3->fn(), 2);
+        EXPECT_EQ(poly4->fn(), 9);
+        EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 0);
+
+        swap(poly1, poly1);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_SMALL2_COUNTERS(0, 1, 0, 1, 0, 0, 1);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 0, 2, 0, 0, 3);
+    EXPECT_SMALL2_COUNTERS(0, 1, 0, 1, 0, 0, 2);
+    EXPECT_RELOCATABLE_COUNTERS(0, 1, 0, 0, 0, 0, 1);
+}
+
+TEST(polymorphic_value, SwapCachedPointer)
+{
+    cached_polymorphic_value<Base> poly1{DerivedSmall{}};
+    cached_polymorphic_value<Base> poly2{DerivedBig{}};
+    swap(poly1, poly2);
+    EXPECT_EQ(poly1->fn(), 2);
+    EXPECT_EQ(poly2->fn(), 1);
+
+    // The cached pointer of the local object follows it
+    cached_polymorphic_value<Base> poly3{DerivedSmall{}};
+    swap(poly2, poly3);
+    poly3 = DerivedBig{};
+    EXPECT_EQ(poly2->fn(), 1);
+}
+
+TEST(polymorphic_value, SwapSort)
+{
+    std::vector<polymorphic_value<Base>> values;
+    for (int i = 0; i < 50; ++i) {
+        auto const value = (i * 37) % 50;
+        if (value % 2) {
+            values.emplace_back(in_place_type<DerivedSmallSpecialFunctions>, value);
+        } else {
+            values.emplace_back(in_place_type<DerivedBigSpecialFunctions>, value);
+        }
+    }
+    std::sort(values.begin(), values.end(), [](auto& a, auto& b) { return a->fn() < b->fn(); });
+    for (int i = 0; i < 50; ++i) {
+        EXPECT_EQ(values[i]->fn(), i);
+    }
+}
+
+#if POLYMORPHIC_VALUE_PMR_SUPPORTED
+TEST(polymorphic_value, SwapUnequalAllocators)
+{
+    std::pmr::unsynchronized_pool_resource resource1;
+    std::pmr::unsynchronized_pool_resource resource2;
+    pmr::polymorphic_value<Base> poly1{std::allocator_arg, &resource1, DerivedBig{}};
+    pmr::polymorphic_value<Base> poly2{std::allocator_arg, &resource2, DerivedSmall{}};
+
+    // The allocators don't propagate, the objects are moved instead
+    swap(poly1, poly2);
+    EXPECT_EQ(poly1->fn(), 1);
+    EXPECT_EQ(poly2->fn(), 2);
+    EXPECT_EQ(poly1.get_allocator().resource(), &resource1);
+    EXPECT_EQ(poly2.get_allocator().resource(), &resource2);
+}
+#endif
+
+template<typename Base>
+using vtable_first_polymorphic_value = polymorphic_value<Base,
+                                                         true,
+                                                         sizeof(void*) * 3,
+                                                         alignof(void*),
+                                                         std::allocator<char>,
+                                                         vtable_first_policy>;
+
+TEST(polymorphic_value, VtableFirst)
+{
+    static_assert(sizeof(vtable_first_polymorphic_value<Base>) == sizeof(polymorphic_value<Base>),
+                  "");
+
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        vtable_first_polymorphic_value<Base> poly1{in_place_type<DerivedSmallSpecialFunctions>, 7};
+        vtable_first_polymorphic_value<Base> poly2{in_place_type<DerivedBigSpecialFunctions>, 8};
+        auto poly3 = poly1;
+        poly1 = poly2;
+        poly2 = std::move(poly3);
+        EXPECT_EQ(poly1->fn(), 8);
+        EXPECT_EQ(poly2->fn(), 7);
+        swap(poly1, poly2);
+        EXPECT_EQ(poly1->fn(), 7);
+        EXPECT_EQ(poly2->fn(), 8);
+        poly2.emplace<DerivedSmall>();
+        EXPECT_EQ(poly2->fn(), 1);
+    }
+    EXPECT_SMALL_COUNTERS(0, 1, 1, 2, 0, 0, 4);
+    EXPECT_BIG_COUNTERS(0, 1, 1, 0, 0, 0, 2);
+}
+
+TEST(polymorphic_value, SboPaddingStoresObjects)
+{
+    struct alignas(16) DerivedPadded : Base {
+        int fn() override { return 4; }
+        char data[32 - sizeof(void*)];
+    };
+
+    // The 20 bytes buffer is padded to 32 bytes, which can hold a DerivedPadded
+    using value_t = polymorphic_value<Base, false, 20, 16>;
+    static_assert(value_t::sbo_size == 32, "");
+    static_assert(sizeof(value_t) == 48, "");
+    static_assert(assert_stored_locally<value_t, DerivedPadded>, "");
+
+    value_t poly{DerivedPadded{}};
+    EXPECT_EQ(poly->fn(), 4);
+}
+
+TEST(polymorphic_value, LayoutReport)
+{
+    static_assert(layout_report<polymorphic_value<Base>>::padding == 0, "");
+    static_assert(layout_report<cached_polymorphic_value<Base>>::object_pointer_size
+                      == sizeof(void*),
+                  "");
+    static_assert(layout_report<cached_polymorphic_value<Base>>::padding == 0, "");
+
+    // The vtable pointer takes a whole alignment unit
+    using aligned_t = polymorphic_value<Base, true, 32, 32>;
+    static_assert(layout_report<aligned_t>::size == 64, "");
+    static_assert(layout_report<aligned_t>::padding == 32 - sizeof(void*), "");
+
+    using counting_t = polymorphic_value<Base,
+                                         true,
+                                         sizeof(void*) * 3,
+                                         alignof(void*),
+                                         counting_allocator<char>>;
+    static_assert(layout_report<counting_t>::allocator_size == sizeof(counting_allocator<char>),
+                  "");
+    static_assert(layout_report<counting_t>::padding == 0, "");
+}
+
+TEST(polymorphic_value, SizedPolymorphicValue)
+{
+    using line_t = sized_polymorphic_value<Base, 64>;
+    static_assert(sizeof(line_t) == 64, "");
+    static_assert(line_t::sbo_size == 64 - sizeof(void*), "");
+    static_assert(layout_report<line_t>::padding == 0, "");
+
+    using aligned_line_t
+        = sized_polymorphic_value<Base, 128, 32, std::allocator<char>, vtable_first_policy>;
+    static_assert(sizeof(aligned_line_t) == 128, "");
+    static_assert(aligned_line_t::sbo_size == 96, "");
+
+    using cached_line_t = sized_polymorphic_value<Base,
+                                                  64,
+                                                  alignof(void*),
+                                                  std::allocator<char>,
+                                                  cached_pointer_policy>;
+    static_assert(sizeof(cached_line_t) == 64, "");
+    static_assert(cached_line_t::sbo_size == 64 - 2 * sizeof(void*), "");
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        line_t poly1{DerivedBig{}};
+        line_t poly2{poly1};
+        EXPECT_EQ(poly2->fn(), 2);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+struct DerivedSerializable : public Base {
+    explicit DerivedSerializable(int value) noexcept : value{value} {}
+    explicit DerivedSerializable(byte_reader& in) : value{in.read<int>()} {}
+
+    void serialize(byte_writer& out) const { out.write(value); }
+    int fn() override { return value; }
+
+    int value;
+};
+
+// Keeps pointing to the bytes it was read from
+struct DerivedBigSerializable : public Base {
+    explicit DerivedBigSerializable(char const* text) noexcept
+        : size{std::strlen(text)}
+        , text{text}
+    {
+    }
+
+    explicit DerivedBigSerializable(byte_reader& in)
+        : size{in.read<std::size_t>()}
+        , text{reinterpret_cast<char const*>(in.take(size))}
+    {
+    }
+
+    void serialize(byte_writer& out) const
+    {
+        out.write(size);
+        out.write(text, size);
+    }
+
+    int fn() override { return static_cast<int>(size); }
+
+    std::size_t size;
+    char const* text;
+    char padding[sizeof(void*) * 2] = {};
+};
+
+struct DerivedSerializable2 : public DerivedSerializable {
+    using DerivedSerializable::DerivedSerializable;
+};
+
+type_registry<polymorphic_value<Base>> make_registry()
+{
+    type_registry<polymorphic_value<Base>> registry;
+    registry.add<DerivedSerializable>(1);
+    registry.add<DerivedBigSerializable>(2);
+    return registry;
+}
+
+TEST(type_registry, RoundTrip)
+{
+    auto const registry = make_registry();
+    EXPECT_TRUE(registry.contains<DerivedSerializable>());
+    EXPECT_TRUE(registry.contains(2));
+    EXPECT_FALSE(registry.contains<DerivedSmall>());
+    EXPECT_FALSE(registry.contains(3));
+
+    std::vector<unsigned char> buffer;
+    byte_writer out{buffer};
+    registry.serialize(polymorphic_value<Base>{DerivedSerializable{7}}, out);
+    registry.serialize(polymorphic_value<Base>{DerivedBigSerializable{"hello"}}, out);
+    EXPECT_EQ(buffer.size(), 2 * sizeof(std::uint32_t) + sizeof(int) + sizeof(std::size_t) + 5);
+
+    byte_reader in{buffer};
+    auto poly1 = registry.deserialize(in);
+    auto poly2 = registry.deserialize(in);
+    EXPECT_EQ(in.remaining(), 0u);
+    EXPECT_EQ(poly1->fn(), 7);
+    EXPECT_EQ(poly2->fn(), 5);
+
+    // The text wasn't copied
+    auto const& big = static_cast<DerivedBigSerializable const&>(*poly2);
+    EXPECT_EQ(reinterpret_cast<unsigned char const*>(big.text), &buffer[buffer.size() - 5]);
+    EXPECT_EQ(std::string(big.text, big.size), "hello");
+}
+
+TEST(type_registry, LittleEndian)
+{
+    std::vector<unsigned char> buffer;
+    byte_writer out{buffer};
+    out.write(std::uint32_t{0x01020304});
+    out.write(std::int16_t{-2});
+    EXPECT_EQ(buffer, (std::vector<unsigned char>{4, 3, 2, 1, 0xfe, 0xff}));
+
+    byte_reader in{buffer};
+    EXPECT_EQ(in.read<std::uint32_t>(), 0x01020304u);
+    EXPECT_EQ(in.read<std::int16_t>(), -2);
+
+    buffer.clear();
+    make_registry().serialize(polymorphic_value<Base>{DerivedSerializable{7}}, out);
+    EXPECT_EQ(buffer, (std::vector<unsigned char>{1, 0, 0, 0, 7, 0, 0, 0}));
+}
+
+TEST(type_registry, Arrays)
+{
+    auto const registry = make_registry();
+
+    std::vector<polymorphic_value<Base>> values;
+    for (int i = 0; i < 20; ++i) {
+        if (i % 5 == 4) {
+            values.emplace_back(DerivedBigSerializable{"abc"});
+        } else {
+            values.emplace_back(DerivedSerializable{i});
+        }
+    }
+
+    std::vector<unsigned char> buffer;
+    byte_writer out{buffer};
+    registry.serialize_n(values.data(), values.size(), out);
+
+    byte_reader in{buffer};
+    value_buffer<polymorphic_value<Base>, 20> read;
+    EXPECT_EQ(registry.deserialize_n(in, 20, read.data()), read.data() + 20);
+    EXPECT_EQ(in.remaining(), 0u);
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(read.data()[i]->fn(), i % 5 == 4 ? 3 : i);
+    }
+    destroy_n(read.data(), 20);
+}
+
+TEST(type_registry, Errors)
+{
+    auto registry = make_registry();
+    EXPECT_THROW(registry.add<DerivedSerializable>(3), std::invalid_argument);
+    EXPECT_THROW(registry.add<DerivedSerializable2>(1), std::invalid_argument);
+
+    std::vector<unsigned char> buffer;
+    byte_writer out{buffer};
+    EXPECT_THROW(registry.serialize(polymorphic_value<Base>{DerivedSmall{}}, out),
+                 serialization_error);
+
+    std::uint32_t const unknown_id = 3;
+    out.write(unknown_id);
+    byte_reader unknown{buffer};
+    EXPECT_THROW(registry.deserialize(unknown), serialization_error);
+
+    // Values read before a failure are destroyed
+    buffer.clear();
+    registry.serialize(polymorphic_value<Base>{in_place_type<DerivedSerializable>, 1}, out);
+    registry.serialize(polymorphic_value<Base>{DerivedBigSerializable{"abc"}}, out);
+    buffer.pop_back();
+    byte_reader truncated{buffer};
+    value_buffer<polymorphic_value<Base>, 2> read;
+    new_call_counter = 0;
+    delete_call_counter = 0;
+    enable_allocator_counters = true;
+    EXPECT_THROW(registry.deserialize_n(truncated, 2, read.data()), serialization_error);
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, delete_call_counter);
+}
+
+// Its move never throws, but isn't declared noexcept
+struct DerivedUnannotatedMove : public Base {
+    explicit DerivedUnannotatedMove(int value) : value{value} {}
+    DerivedUnannotatedMove(DerivedUnannotatedMove const&) = default;
+    DerivedUnannotatedMove(DerivedUnannotatedMove&& o) : value{o.value} { o.value = 0; }
+    DerivedUnannotatedMove& operator=(DerivedUnannotatedMove const&) = default;
+    DerivedUnannotatedMove& operator=(DerivedUnannotatedMove&& o)
+    {
+        value = o.value;
+        o.value = 0;
+        return *this;
+    }
+
+    int fn() override { return value; }
+
+    int value;
+};
+
+template<>
+struct pmv::is_nothrow_movable<DerivedUnannotatedMove> : std::true_type {
+};
+
+TEST(polymorphic_value, NothrowMovableOverride)
+{
+    static_assert(heap_storage_reasons<polymorphic_value<Base>, DerivedThrowingMove>::throwing_move,
+                  "");
+    static_assert(
+        !heap_storage_reasons<polymorphic_value<Base>, DerivedUnannotatedMove>::stored_in_heap, "");
+    static_assert(assert_stored_locally<polymorphic_value_for<Base, DerivedUnannotatedMove>,
+                                        DerivedUnannotatedMove>,
+                  "");
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        polymorphic_value<Base> poly1{DerivedUnannotatedMove{7}};
+        polymorphic_value<Base> poly2{std::move(poly1)};
+        polymorphic_value<Base> poly3{poly2};
+        poly1 = std::move(poly3);
+        EXPECT_EQ(poly1->fn(), 7);
+        EXPECT_EQ(poly2->fn(), 7);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+
+    polymorphic_vector<Base> values;
+    values.emplace_back<DerivedUnannotatedMove>(8);
+    values.emplace_back<DerivedBig>();
+    EXPECT_EQ(values[0].fn(), 8);
+}
+
+#if POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED
+struct Handler {
+    virtual constexpr ~Handler() = default;
+    virtual constexpr int handle(int x) const = 0;
+};
+
+struct AddHandler final : public Handler {
+    constexpr explicit AddHandler(int n) noexcept : n{n} {}
+    // Not defaulted, GCC 12 fails to evaluate implicit virtual destructors
+    constexpr ~AddHandler() override {}
+    constexpr int handle(int x) const override { return x + n; }
+
+    int n;
+};
+
+struct MultiplyHandler final : public Handler {
+    constexpr explicit MultiplyHandler(int n) noexcept : n{n} {}
+    constexpr ~MultiplyHandler() override {}
+    constexpr int handle(int x) const override { return x * n; }
+
+    int n;
+};
+
+using handler_t = closed_polymorphic_value<Handler, AddHandler, MultiplyHandler>;
+
+// Built at compile time, without any static initialization
+constexpr handler_t handlers[] = {
+    AddHandler{1}, MultiplyHandler{3}, handler_t{in_place_type<AddHandler>, 5}};
+
+static_assert(handlers[0]->handle(2) == 3, "");
+static_assert(handlers[1]->handle(2) == 6, "");
+static_assert(handlers[2].holds<AddHandler>(), "");
+
+constexpr int modify_handlers()
+{
+    handler_t a{AddHandler{1}};
+    handler_t b{a};
+    b = MultiplyHandler{2};
+    a = b;
+    b.emplace<AddHandler>(4);
+    handler_t c{std::move(b)};
+    return a->handle(3) + c.visit([](auto const& h) { return h.n; });
+}
+
+static_assert(modify_handlers() == 10, "");
+
+TEST(closed_polymorphic_value, Constexpr)
+{
+    int sum = 0;
+    for (auto const& handler : handlers) {
+        sum += handler->handle(2);
+    }
+    EXPECT_EQ(sum, 16);
+    EXPECT_EQ(modify_handlers(), 10);
+}
+#endif
+
+TEST(polymorphic_value, MemoryUsage)
+{
+    polymorphic_value<Base> small{DerivedSmall{}};
+    polymorphic_value<Base> big{DerivedBig{}};
+    EXPECT_TRUE(small.is_inline());
+    EXPECT_FALSE(big.is_inline());
+    EXPECT_EQ(small.dynamic_size(), sizeof(DerivedSmall));
+    EXPECT_EQ(small.alignment(), alignof(DerivedSmall));
+    EXPECT_EQ(big.dynamic_size(), sizeof(DerivedBig));
+    EXPECT_EQ(small.size_in_bytes(), sizeof(small));
+    EXPECT_EQ(big.size_in_bytes(), sizeof(big) + sizeof(DerivedBig));
+
+    // Heap objects stay in the heap of larger values
+    large_polymorphic_value<Base> large{std::move(big)};
+    EXPECT_FALSE(large.is_inline());
+    EXPECT_EQ(large.dynamic_size(), sizeof(DerivedBig));
+    EXPECT_TRUE(big.is_inline());
+    EXPECT_EQ(big.dynamic_size(), 0u);
+
+    cow_polymorphic_value<Base> shared{DerivedBig{}};
+    auto const copy = shared;
+    EXPECT_EQ(copy.size_in_bytes(), sizeof(copy) + sizeof(detail::shared_block<DerivedBig>));
+
+    polymorphic_value<Base> const values[] = {small, DerivedBig{}, DerivedBig{}};
+    auto const usage = measure_memory(values);
+    EXPECT_EQ(usage.values, 3u);
+    EXPECT_EQ(usage.heap_objects, 2u);
+    EXPECT_EQ(usage.inline_bytes, sizeof(small) * 3);
+    EXPECT_EQ(usage.heap_bytes, sizeof(DerivedBig) * 2);
+    EXPECT_EQ(usage.total_bytes(), usage.inline_bytes + usage.heap_bytes);
+    EXPECT_EQ(measure_memory(values + 1, values + 3).heap_objects, 2u);
+}
+
+TEST(polymorphic_value, HoldsAndTarget)
+{
+    polymorphic_value<Base> value{DerivedSmall{}};
+    EXPECT_TRUE(value.holds<DerivedSmall>());
+    EXPECT_FALSE(value.holds<DerivedBig>());
+    EXPECT_EQ(value.target<DerivedSmall>(), &*value);
+    EXPECT_EQ(value.target<DerivedBig>(), nullptr);
+
+    value = DerivedBig{};
+    auto const& const_value = value;
+    EXPECT_TRUE(const_value.holds<DerivedBig>());
+    EXPECT_EQ(const_value.target<DerivedBig>(), &*const_value);
+    EXPECT_EQ(const_value.target<DerivedSmall>(), nullptr);
+
+    // Heap objects stay in the heap when converted to a larger buffer
+    polymorphic_value<Base, true, sizeof(DerivedBig)> large{std::move(value)};
+    EXPECT_TRUE(large.holds<DerivedBig>());
+    EXPECT_EQ(large.target<DerivedBig>(), &*large);
+    EXPECT_FALSE(value.holds<DerivedBig>());
+    EXPECT_EQ(value.target<DerivedBig>(), nullptr);
+
+    cached_polymorphic_value<Base> cached{DerivedBig{}};
+    EXPECT_EQ(cached.target<DerivedBig>(), &*cached);
+
+    // Non const access to a shared object copies it first
+    cow_polymorphic_value<Base> const shared{in_place_type<DerivedBigSpecialFunctions>, 4};
+    cow_polymorphic_value<Base> copy{shared};
+    EXPECT_EQ(static_cast<cow_polymorphic_value<Base> const&>(copy)
+                  .target<DerivedBigSpecialFunctions>(),
+              &*shared);
+    auto* const owned = copy.target<DerivedBigSpecialFunctions>();
+    EXPECT_NE(owned, &*shared);
+    EXPECT_EQ(owned->fn(), 4);
+}
+
+TEST(polymorphic_value, Visit)
+{
+    auto const f = [](auto& object) -> std::string {
+        using type = std::remove_const_t<std::remove_reference_t<decltype(object)>>;
+        if (std::is_same<type, DerivedSmall>::value) {
+            return "small";
+        } else if (std::is_same<type, DerivedBig>::value) {
+            return "big";
+        }
+        // Base::fn() isn't const
+        return "base " + std::to_string(const_cast<type&>(object).fn());
+    };
+
+    polymorphic_value<Base> value{DerivedBig{}};
+    EXPECT_EQ((value.visit<DerivedSmall, DerivedBig>(f)), "big");
+    EXPECT_EQ((value.visit<DerivedBig, DerivedSmall>(f)), "big");
+    EXPECT_EQ(value.visit<DerivedSmall>(f), "base 2");
+    EXPECT_EQ(value.visit<>(f), "base 2");
+
+    value = DerivedSmall{};
+    auto const& const_value = value;
+    EXPECT_EQ((const_value.visit<DerivedSmall, DerivedBig>(f)), "small");
+    EXPECT_EQ(const_value.visit<DerivedBig>(f), "base 1");
+
+    // The object can be modified through the visitor
+    polymorphic_value<Base> counter{in_place_type<DerivedBigSpecialFunctions>, 1};
+    counter.visit<DerivedBigSpecialFunctions>(
+        [](auto& object) { object = DerivedBigSpecialFunctions{7}; });
+    EXPECT_EQ(counter->fn(), 7);
+}
+
+// Keeps the events of the values tracing their operations with it
+struct recording_tracer {
+    struct record {
+        bool begin;
+        trace_event event;
+    };
+
+    static std::vector<record> records;
+
+    static void begin(trace_event const& event) noexcept { records.push_back({true, event}); }
+    static void end(trace_event const& event) noexcept { records.push_back({false, event}); }
+
+    // Checks that the next records are the begin and end of the operation
+    static void expect(std::size_t& i,
+                       trace_operation operation,
+                       char const* name,
+                       std::size_t size,
+                       bool in_heap,
+                       std::size_t count,
+                       int line)
+    {
+        SCOPED_TRACE(line);
+        ASSERT_LE(i + 2, records.size());
+        for (bool const begin : {true, false}) {
+            auto const& r = records[i++];
+            EXPECT_EQ(r.begin, begin);
+            EXPECT_EQ(r.event.operation, operation);
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+            EXPECT_STREQ(r.event.type_name, name);
+#else
+            (void)name;
+#endif
+            EXPECT_EQ(r.event.size, size);
+            EXPECT_EQ(r.event.in_heap, in_heap);
+            EXPECT_EQ(r.event.count, count);
+        }
+    }
+};
+
+std::vector<recording_tracer::record> recording_tracer::records;
+
+struct traced_policy : default_policy {
+    using tracer = recording_tracer;
+};
+
+template<typename Base_>
+using traced_polymorphic_value = polymorphic_value<Base_,
+                                                   true,
+                                                   sizeof(void*) * 3,
+                                                   alignof(void*),
+                                                   std::allocator<char>,
+                                                   traced_policy>;
+
+#define EXPECT_TRACE(operation, Derived, in_heap, count)                                           \
+    recording_tracer::expect(i,                                                                    \
+                             trace_operation::operation,                                           \
+                             detail::type_name<Derived>(),                                         \
+                             sizeof(Derived),                                                      \
+                             in_heap,                                                              \
+                             count,                                                                \
+                             __LINE__)
+
+TEST(polymorphic_value, Tracer)
+{
+    recording_tracer::records.clear();
+    {
+        traced_polymorphic_value<Base> small{DerivedSmall{}};
+        auto small_copy = small;
+        traced_polymorphic_value<Base> big{DerivedBig{}};
+        auto big_copy = big;
+        big_copy = big;
+        auto moved = std::move(big);
+    }
+    std::size_t i = 0;
+    EXPECT_TRACE(copy_construct, DerivedSmall, false, 1);
+    EXPECT_TRACE(copy_construct, DerivedBig, true, 1);
+    EXPECT_TRACE(copy_assign, DerivedBig, true, 1);
+    // Heap objects are stolen without calling the vtable, and moved from
+    // values have nothing to trace
+    EXPECT_TRACE(destroy, DerivedBig, true, 1);
+    EXPECT_TRACE(destroy, DerivedBig, true, 1);
+    EXPECT_TRACE(destroy, DerivedSmall, false, 1);
+    EXPECT_TRACE(destroy, DerivedSmall, false, 1);
+    EXPECT_EQ(i, recording_tracer::records.size());
+
+    // Array operations are reported once, with the number of objects
+    recording_tracer::records.clear();
+    traced_polymorphic_value<Base> const values[] = {DerivedBig{}, DerivedBig{}, DerivedBig{}};
+    alignas(traced_polymorphic_value<Base>) unsigned char buffer[sizeof(values)];
+    auto* const copies = reinterpret_cast<traced_polymorphic_value<Base>*>(buffer);
+    pmv::uninitialized_copy_n(values, 3, copies);
+    pmv::destroy_n(copies, 3);
+    i = 0;
+    EXPECT_TRACE(copy_n, DerivedBig, true, 3);
+    EXPECT_TRACE(destroy_n, DerivedBig, true, 3);
+    EXPECT_EQ(i, recording_tracer::records.size());
+
+    // The end of throwing operations is reported too
+    recording_tracer::records.clear();
+    traced_polymorphic_value<Base> throwing{DerivedThrowingCopy{}};
+    DerivedThrowingCopy::copies_left = 0;
+    EXPECT_THROW(traced_polymorphic_value<Base>{throwing}, std::runtime_error);
+    i = 0;
+    EXPECT_TRACE(copy_construct, DerivedThrowingCopy, false, 1);
+    EXPECT_EQ(i, recording_tracer::records.size());
+
+    // Values without a tracer call the storage functions directly
+    using layout = detail::storage_layout<alignof(void*), std::allocator<char>, false, true>;
+    EXPECT_EQ((detail::vtable_for<DerivedBig, layout, true>::get()->destroy),
+              (&detail::heap_storage::destroy<DerivedBig, layout>));
+    EXPECT_EQ((detail::vtable_for<DerivedSmall, layout, false>::get()->copy_construct),
+              (&detail::local_storage::copy<DerivedSmall, layout>));
+}
+
+#undef EXPECT_TRACE
+
+// Base::fn() isn't const, the tests' types don't modify themselves in it
+template<typename Guard>
+int read_fn(Guard const& guard)
+{
+    return const_cast<Base&>(*guard).fn();
+}
+
+TEST(atomic_polymorphic_value, ReadAndExchange)
+{
+    atomic_polymorphic_value<polymorphic_value<Base>> slot{DerivedSmall{}};
+    EXPECT_EQ(slot.version(), 0u);
+    {
+        auto const guard = slot.read();
+        EXPECT_EQ(guard.version(), 0u);
+        EXPECT_EQ(read_fn(guard.value()), 1);
+    }
+
+    slot.store(DerivedBig{});
+    EXPECT_EQ(read_fn(slot.read()), 2);
+
+    auto previous = slot.exchange(DerivedSmall{});
+    EXPECT_EQ(previous->fn(), 2);
+    EXPECT_EQ(read_fn(slot.read()), 1);
+    EXPECT_EQ(slot.version(), 2u);
+
+    polymorphic_value<Base> desired{DerivedBig{}};
+    EXPECT_FALSE(slot.compare_exchange(1, desired));
+    EXPECT_EQ(desired->fn(), 2);
+    EXPECT_EQ(read_fn(slot.read()), 1);
+
+    EXPECT_TRUE(slot.compare_exchange(2, desired));
+    EXPECT_EQ(read_fn(slot.read()), 2);
+    EXPECT_EQ(slot.version(), 3u);
+}
+
+TEST(atomic_polymorphic_value, VersionWhileWriting)
+{
+    atomic_polymorphic_value<polymorphic_value<Base>> slot{DerivedBig{}};
+
+    std::atomic<bool> done{false};
+    std::atomic<int> bad_versions{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            std::uint64_t last = 0;
+            while (!done.load()) {
+                auto const version = slot.version();
+                if (version < last) {
+                    bad_versions.fetch_add(1);
+                }
+                last = version;
+            }
+        });
+    }
+
+    for (int i = 0; i < 200; ++i) {
+        slot.store(DerivedBig{});
+    }
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+
+    EXPECT_EQ(bad_versions.load(), 0);
+    EXPECT_EQ(slot.version(), 200u);
+}
+
+// Checks that readers never see a destroyed object
+struct DerivedCanary : public Base {
+    explicit DerivedCanary(int v) noexcept : value{v} {}
+    DerivedCanary(DerivedCanary const&) = default;
+    ~DerivedCanary() override { alive = false; }
+
+    int fn() override { return alive ? value : -1; }
+
+    int value;
+    bool alive = true;
+    char data[sizeof(void*) * 4] = {};
+};
+
+TEST(atomic_polymorphic_value, ConcurrentReadersAndWriters)
+{
+    using value_t = polymorphic_value<Base>;
+    atomic_polymorphic_value<value_t> slot{value_t{in_place_type<DerivedCanary>, 0}};
+
+    std::atomic<bool> done{false};
+    std::atomic<int> bad_reads{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            int last = 0;
+            while (!done.load()) {
+                auto const guard = slot.read();
+                auto const value = read_fn(guard);
+                if (value < last) {
+                    bad_reads.fetch_add(1);
+                }
+                last = value;
+            }
+        });
+    }
+
+    std::thread writer{[&] {
+        for (int i = 1; i <= 200; ++i) {
+            if (i % 2) {
+                slot.store(value_t{in_place_type<DerivedCanary>, i});
+            } else {
+                auto const version = slot.version();
+                value_t desired{in_place_type<DerivedCanary>, i};
+                EXPECT_TRUE(slot.compare_exchange(version, desired));
+            }
+        }
+    }};
+
+    writer.join();
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+
+    EXPECT_EQ(bad_reads.load(), 0);
+    EXPECT_EQ(read_fn(slot.read()), 200);
+}
+
+struct DerivedThrowingConstructor : public Base {
+    static int failures_left;
+
+    explicit DerivedThrowingConstructor(int v) : value{v}
+    {
+        if (failures_left > 0) {
+            --failures_left;
+            throw std::runtime_error{"construction"};
+        }
+    }
+
+    int fn() override { return value; }
+
+    int value;
+};
+
+int DerivedThrowingConstructor::failures_left = 0;
+
+TEST(lazy_polymorphic_value, BuiltOnFirstAccess)
+{
+    DerivedBigSpecialFunctions::reset_counters();
+    lazy_polymorphic_value<polymorphic_value<Base>> lazy{in_place_type<DerivedBigSpecialFunctions>,
+                                                         5};
+    EXPECT_FALSE(lazy.is_built());
+    EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 0);
+
+    // Moves move the arguments, not the object
+    auto moved = std::move(lazy);
+    EXPECT_FALSE(moved.is_built());
+    EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 0);
+
+    EXPECT_EQ(moved->fn(), 5);
+    EXPECT_TRUE(moved.is_built());
+    EXPECT_EQ(moved.value().holds<DerivedBigSpecialFunctions>(), true);
+    EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 1);
+    EXPECT_EQ((*moved).fn(), 5);
+    EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 1);
+
+    // Copies of unbuilt values build the object of the source
+    lazy_polymorphic_value<polymorphic_value<Base>> const source{in_place_type<DerivedSmall>};
+    auto copy = source;
+    EXPECT_TRUE(source.is_built());
+    EXPECT_TRUE(copy.is_built());
+    EXPECT_EQ(copy->fn(), 1);
+
+    copy = std::move(moved);
+    EXPECT_EQ(copy->fn(), 5);
+    lazy_polymorphic_value<polymorphic_value<Base>> built{polymorphic_value<Base>{DerivedBig{}}};
+    EXPECT_TRUE(built.is_built());
+    EXPECT_EQ(built->fn(), 2);
+
+    // Never accessed, never built
+    {
+        lazy_polymorphic_value<polymorphic_value<Base>> unused{
+            in_place_type<DerivedBigSpecialFunctions>, 6};
+    }
+    EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 1);
+}
+
+struct DerivedNamed : public Base {
+    explicit DerivedNamed(std::string n) : name{std::move(n)} {}
+
+    int fn() override { return static_cast<int>(name.size()); }
+
+    std::string name;
+};
+
+TEST(lazy_polymorphic_value, ArgumentsAreNotAllocated)
+{
+    using value_t = polymorphic_value<Base, true, sizeof(void*) + sizeof(std::string)>;
+    std::string name(100, 'x');
+
+    new_call_counter = 0;
+    {
+        enable_allocator_counters = true;
+        lazy_polymorphic_value<value_t> unused{in_place_type<DerivedNamed>, std::move(name)};
+        enable_allocator_counters = false;
+    }
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+struct DerivedOwning : public Base {
+    explicit DerivedOwning(std::unique_ptr<int> v) : value{std::move(v)} {}
+
+    int fn() override { return *value; }
+
+    std::unique_ptr<int> value;
+};
+
+TEST(lazy_polymorphic_value, ArgumentsAreMoved)
+{
+    using move_only_t = polymorphic_value<Base,
+                                          true,
+                                          sizeof(void*) * 3,
+                                          alignof(void*),
+                                          std::allocator<char>,
+                                          move_only_policy>;
+    lazy_polymorphic_value<move_only_t> lazy{in_place_type<DerivedOwning>,
+                                             std::make_unique<int>(4)};
+    EXPECT_EQ(lazy->fn(), 4);
+
+    using value_t = polymorphic_value<Base, true, sizeof(void*) + sizeof(std::string)>;
+    std::string name(100, 'x');
+    lazy_polymorphic_value<value_t> named{in_place_type<DerivedNamed>, std::move(name)};
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    auto const size = named->fn();
+    enable_allocator_counters = false;
+    EXPECT_EQ(size, 100);
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+TEST(lazy_polymorphic_value, FailedConstructionIsRetried)
+{
+    lazy_polymorphic_value<polymorphic_value<Base>, false, true> lazy{
+        in_place_type<DerivedThrowingConstructor>, 3};
+    DerivedThrowingConstructor::failures_left = 1;
+    EXPECT_THROW(lazy->fn(), std::runtime_error);
+    EXPECT_FALSE(lazy.is_built());
+    EXPECT_EQ(lazy->fn(), 3);
+}
+
+TEST(lazy_polymorphic_value, ThreadSafe)
+{
+    for (int round = 0; round < 20; ++round) {
+        DerivedBigSpecialFunctions::reset_counters();
+        lazy_polymorphic_value<polymorphic_value<Base>, true> const lazy{
+            in_place_type<DerivedBigSpecialFunctions>, round};
+
+        std::vector<std::thread> threads;
+        std::atomic<int> sum{0};
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] { sum += const_cast<Base&>(*lazy).fn(); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        EXPECT_EQ(sum, round * 4);
+        EXPECT_EQ(DerivedBigSpecialFunctions::non_default_ctor_counter, 1);
+    }
+}
+
+using inplace_value_t = inplace_polymorphic_value<Base, sizeof(void*) * 6>;
+
+template<typename Derived>
+static void expect_all_destroyed()
+{
+    EXPECT_EQ(Derived::destructor_ctor_counter,
+              Derived::default_ctor_counter + Derived::non_default_ctor_counter
+                  + Derived::copy_ctor_counter + Derived::move_ctor_counter);
+}
+
+TEST(inplace_polymorphic_value, Storage)
+{
+    static_assert(sizeof(inplace_polymorphic_value<Base>) == sizeof(void*) * 4, "");
+    static_assert(sizeof(inplace_value_t) == inplace_value_t::sbo_size + sizeof(void*), "");
+    static_assert(inplace_polymorphic_value<Base, sizeof(void*) + 1>::sbo_size == sizeof(void*) * 2,
+                  "");
+
+    new_call_counter = 0;
+    enable_allocator_counters = true;
+    {
+        inplace_value_t big{DerivedBig{}};
+        inplace_value_t copy = big;
+        EXPECT_EQ(static_cast<void const*>(&*big), static_cast<void const*>(&big));
+        EXPECT_EQ(copy->fn(), 2);
+        copy = DerivedSmall{};
+        EXPECT_EQ(copy->fn(), 1);
+        copy.emplace<DerivedBig>();
+        EXPECT_EQ(copy->fn(), 2);
+    }
+    enable_allocator_counters = false;
+    EXPECT_EQ(new_call_counter, 0);
+}
+
+TEST(inplace_polymorphic_value, CopyMoveAndAssignment)
+{
+    DerivedSmallSpecialFunctions::reset_counters();
+    DerivedBigSpecialFunctions::reset_counters();
+    {
+        inplace_value_t small{in_place_type<DerivedSmallSpecialFunctions>, 1};
+        inplace_value_t big{in_place_type<DerivedBigSpecialFunctions>, 2};
+
+        auto copy = big;
+        auto moved = std::move(copy);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 0, 0, 0);
+        moved = big;
+        moved = std::move(copy);
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 1, 1, 0);
+
+        moved = small;
+        EXPECT_BIG_COUNTERS(0, 1, 1, 1, 1, 1, 1);
+        EXPECT_SMALL_COUNTERS(0, 1, 1, 0, 0, 0, 0);
+        EXPECT_EQ(moved->fn(), 1);
+        EXPECT_TRUE(moved.holds<DerivedSmallSpecialFunctions>());
+        EXPECT_EQ(moved.target<DerivedBigSpecialFunctions>(), nullptr);
+        EXPECT_EQ(std::as_const(big).target<DerivedBigSpecialFunctions>()->value, 2);
+
+        swap(small, big);
+        EXPECT_EQ(small->fn(), 2);
+        EXPECT_EQ(big->fn(), 1);
+        big = DerivedBigSpecialFunctions{3};
+        EXPECT_EQ(big->fn(), 3);
+    }
+    expect_all_destroyed<DerivedSmallSpecialFunctions>();
+    expect_all_destroyed<DerivedBigSpecialFunctions>();
+}
+
+TEST(inplace_polymorphic_value, Relocation)
+{
+    DerivedRelocatable::reset_counters();
+    {
+        inplace_value_t a{in_place_type<DerivedRelocatable>, 3};
+        inplace_value_t b{in_place_type<DerivedRelocatable>, 4};
+
+        // Moves copy the buffer and leave the source moved from
+        auto c = std::move(a);
+        swap(b, c);
+        EXPECT_RELOCATABLE_COUNTERS(0, 2, 0, 0, 0, 0, 0);
+        EXPECT_EQ(b->fn(), 3);
+        EXPECT_EQ(c->fn(), 4);
+
+        auto copy_of_moved = a;
+        a = std::move(copy_of_moved);
+        a = c;
+        EXPECT_RELOCATABLE_COUNTERS(0, 2, 1, 0, 0, 0, 0);
+        EXPECT_EQ(a->fn(), 4);
+    }
+    EXPECT_RELOCATABLE_COUNTERS(0, 2, 1, 0, 0, 0, 3);
+}
+
+TEST(inplace_polymorphic_value, ThrowingConstruction)
+{
+    inplace_value_t value{DerivedSmall{}};
+    DerivedThrowingConstructor::failures_left = 1;
+    EXPECT_THROW(value.emplace<DerivedThrowingConstructor>(5), std::runtime_error);
+    value.emplace<DerivedThrowingConstructor>(5);
+    EXPECT_EQ(value->fn(), 5);
+}
+
+struct DerivedParallelCopy : public Base {
+    static std::atomic<int> live;
+
+    explicit DerivedParallelCopy(int v, bool f = false) : value{v}, fail{f} { ++live; }
+    DerivedParallelCopy(DerivedParallelCopy const& src) : value{src.value}, fail{src.fail}
+    {
+        if (fail) {
+            throw std::runtime_error{"copy"};
+        }
+        ++live;
+    }
+    DerivedParallelCopy& operator=(DerivedParallelCopy const&) = default;
+    ~DerivedParallelCopy() override { --live; }
+
+    int fn() override { return value; }
+
+    int value;
+    bool fail;
+    char data[sizeof(void*) * 4] = {};
+};
+
+std::atomic<int> DerivedParallelCopy::live{0};
+
+constexpr std::size_t parallel_count = 4 * detail::min_parallel_chunk;
+
+static std::vector<polymorphic_value<Base>> make_parallel_values()
+{
+    std::vector<polymorphic_value<Base>> values;
+    values.reserve(parallel_count);
+    for (std::size_t i = 0; i < parallel_count; ++i) {
+        if (i % 2 == 0) {
+            values.emplace_back(in_place_type<DerivedSmall>);
+        } else {
+            values.emplace_back(in_place_type<DerivedParallelCopy>, static_cast<int>(i));
+        }
+    }
+    return values;
+}
+
+TEST(parallel_algorithms, Copy)
+{
+    {
+        auto const values = make_parallel_values();
+        static value_buffer<polymorphic_value<Base>, parallel_count> copies;
+        EXPECT_EQ(parallel_uninitialized_copy_n(values.data(), parallel_count, copies.data(), 4),
+                  copies.data() + parallel_count);
+        for (std::size_t i = 0; i < parallel_count; ++i) {
+            auto& copy = copies[i];
+            EXPECT_EQ(copy->fn(), i % 2 == 0 ? 1 : static_cast<int>(i));
+            EXPECT_NE(&*copy, &*values[i]);
+        }
+        EXPECT_EQ(DerivedParallelCopy::live, static_cast<int>(parallel_count));
+        pmv::destroy_n(copies.data(), parallel_count);
+
+        // Too few values to be worth a thread
+        value_buffer<polymorphic_value<Base>, 3> few;
+        parallel_uninitialized_copy_n(values.data(), 3, few.data());
+        EXPECT_EQ(few[1]->fn(), 1);
+        pmv::destroy_n(few.data(), 3);
+        parallel_uninitialized_copy_n(values.data(), 0, few.data());
+    }
+    EXPECT_EQ(DerivedParallelCopy::live, 0);
+}
+
+TEST(parallel_algorithms, CopyThrows)
+{
+    {
+        auto values = make_parallel_values();
+        values[parallel_count - 3] = DerivedParallelCopy{0, true};
+        static value_buffer<polymorphic_value<Base>, parallel_count> copies;
+        EXPECT_THROW(
+            parallel_uninitialized_copy_n(values.data(), parallel_count, copies.data(), 4),
+            std::runtime_error);
+
+        // The copies of all the chunks are destroyed
+        EXPECT_EQ(DerivedParallelCopy::live, static_cast<int>(parallel_count / 2));
+    }
+    EXPECT_EQ(DerivedParallelCopy::live, 0);
+}
+
+TEST(parallel_algorithms, Transform)
+{
+    std::vector<int> ints(parallel_count);
+    for (std::size_t i = 0; i < parallel_count; ++i) {
+        ints[i] = static_cast<int>(i);
+    }
+    static value_buffer<polymorphic_value<Base>, parallel_count> values;
+    parallel_uninitialized_transform_n(
+        ints.data(),
+        parallel_count,
+        values.data(),
+        [](int i) {
+            return i % 3 == 0 ? polymorphic_value<Base>{DerivedParallelCopy{i}}
+                              : polymorphic_value<Base>{DerivedSmall{}};
+        },
+        4);
+    for (std::size_t i = 0; i < parallel_count; ++i) {
+        EXPECT_EQ(values[i]->fn(), i % 3 == 0 ? static_cast<int>(i) : 1);
+    }
+    pmv::destroy_n(values.data(), parallel_count);
+    EXPECT_EQ(DerivedParallelCopy::live, 0);
+}
+
+#if POLYMORPHIC_VALUE_PMR_SUPPORTED
+TEST(parallel_algorithms, CopyWithArenaPerChunk)
+{
+    std::vector<pmr::polymorphic_value<Base>> values;
+    for (std::size_t i = 0; i < parallel_count; ++i) {
+        values.emplace_back(in_place_type<DerivedParallelCopy>, static_cast<int>(i));
+    }
+
+    std::pmr::monotonic_buffer_resource arenas[4];
+    std::thread::id threads[4];
+    static value_buffer<pmr::polymorphic_value<Base>, parallel_count> copies;
+    parallel_uninitialized_copy_n(
+        std::allocator_arg,
+        [&](std::size_t chunk) {
+            threads[chunk] = std::this_thread::get_id();
+            return std::pmr::polymorphic_allocator<char>{&arenas[chunk]};
+        },
+        values.data(),
+        parallel_count,
+        copies.data(),
+        4);
+
+    auto const chunk_size = parallel_count / 4;
+    for (std::size_t i = 0; i < parallel_count; ++i) {
+        EXPECT_EQ(copies[i]->fn(), static_cast<int>(i));
+        EXPECT_EQ(copies[i].get_allocator().resource(), &arenas[i / chunk_size]);
+    }
+    EXPECT_EQ(threads[0], std::this_thread::get_id());
+    EXPECT_NE(threads[1], threads[0]);
+    pmv::destroy_n(copies.data(), parallel_count);
+}
+#endif
+
+#if POLYMORPHIC_VALUE_STATISTICS
+
+template<typename Derived>
+static type_statistics const& get_statistics()
+{
+    using storage_t = detail::sbo_storage<sizeof(void*) * 3, alignof(void*), std::allocator<char>>;
+    return *detail::get_vtable<Derived, storage_t>::get()->info->statistics;
+}
+
+TEST(polymorphic_value, Statistics)
+{
+    reset_statistics();
+    {
+        polymorphic_value<Base> small{DerivedSmall{}};
+        polymorphic_value<Base> big{DerivedBig{}};
+        auto copy = big;
+        copy = small;
+        auto moved = std::move(big);
+        moved = DerivedBig{};
+    }
+
+    auto const* small = &get_statistics<DerivedSmall>();
+    auto const* big = &get_statistics<DerivedBig>();
+    EXPECT_EQ(std::string{small->name}, typeid(DerivedSmall).name());
+
+    EXPECT_FALSE(small->in_heap);
+    EXPECT_EQ(small->local_constructions, 2u);
+    EXPECT_EQ(small->heap_constructions, 0u);
+    EXPECT_EQ(small->copies, 1u);
+    EXPECT_EQ(small->moves, 0u);
+    EXPECT_EQ(small->cross_type_assignments, 1u);
+    EXPECT_EQ(small->bytes_allocated, 0u);
+
+    EXPECT_TRUE(big->in_heap);
+    EXPECT_EQ(big->local_constructions, 0u);
+    EXPECT_EQ(big->heap_constructions, 2u);
+    EXPECT_EQ(big->copies, 1u);
+    EXPECT_EQ(big->moves, 2u);
+    EXPECT_EQ(big->cross_type_assignments, 0u);
+    EXPECT_EQ(big->bytes_allocated, sizeof(DerivedBig) * 2);
+
+    std::ostringstream os;
+    dump_statistics(os);
+    EXPECT_NE(os.str().find(typeid(DerivedBig).name()), std::string::npos);
+    EXPECT_NE(os.str().find("storage=heap"), std::string::npos);
+
+    reset_statistics();
+    EXPECT_EQ(big->heap_constructions, 0u);
+}
+
+#endif
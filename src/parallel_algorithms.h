@@ -0,0 +1,171 @@
+#ifndef PARALLEL_ALGORITHMS_INCLUDE_H
+#define PARALLEL_ALGORITHMS_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pmv {
+
+namespace detail {
+
+// Fewer values are copied by a single thread, as starting a thread costs
+// about as much as copying them
+constexpr std::size_t min_parallel_chunk = 4096;
+
+template<typename T>
+void destroy_objects(T* first, std::size_t n) noexcept
+{
+    for (std::size_t i = 0; i < n; ++i) {
+        first[i].~T();
+    }
+}
+
+inline std::size_t default_thread_count() noexcept
+{
+    auto const count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+// Call construct(chunk, begin, end) on consecutive chunks of [0, n), one per
+// thread, the first one on the calling thread. construct builds values in
+// uninitialized memory, and destroys them if it throws. If any chunk throws,
+// the values of the others are destroyed with destroy(begin, end) and the
+// first exception is rethrown.
+template<typename Construct, typename Destroy>
+void construct_in_chunks(std::size_t n,
+                         std::size_t max_threads,
+                         Construct const& construct,
+                         Destroy const& destroy)
+{
+    auto const threads = std::max<std::size_t>(
+        1, std::min(max_threads, (n + min_parallel_chunk - 1) / min_parallel_chunk));
+    auto const chunk_size = (n + threads - 1) / threads;
+    auto const begin_of = [&](std::size_t chunk) { return std::min(n, chunk * chunk_size); };
+
+    std::vector<std::exception_ptr> errors(threads);
+    auto const run = [&](std::size_t chunk) noexcept {
+        try {
+            construct(chunk, begin_of(chunk), begin_of(chunk + 1));
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    try {
+        for (std::size_t chunk = 1; chunk < threads; ++chunk) {
+            workers.emplace_back(run, chunk);
+        }
+    } catch (...) {
+        // Chunks without a thread are done by this one
+        for (auto chunk = workers.size() + 1; chunk < threads; ++chunk) {
+            run(chunk);
+        }
+    }
+    run(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    auto const failed = std::find_if(
+        errors.begin(), errors.end(), [](std::exception_ptr const& e) { return e != nullptr; });
+    if (failed != errors.end()) {
+        for (std::size_t chunk = 0; chunk < threads; ++chunk) {
+            if (!errors[chunk]) {
+                destroy(begin_of(chunk), begin_of(chunk + 1));
+            }
+        }
+        std::rethrow_exception(*failed);
+    }
+}
+
+} // namespace detail
+
+// Copy n values into uninitialized memory like pmv::uninitialized_copy_n,
+// with up to max_threads threads copying consecutive chunks of them. The
+// calling thread copies the first chunk. If a copy throws, all the copies
+// are destroyed and the first exception is rethrown. Returns the end of the
+// copies.
+template<typename Value>
+Value* parallel_uninitialized_copy_n(Value const* first,
+                                     std::size_t n,
+                                     Value* d_first,
+                                     std::size_t max_threads = detail::default_thread_count())
+{
+    detail::construct_in_chunks(
+        n,
+        max_threads,
+        [&](std::size_t, std::size_t begin, std::size_t end) {
+            pmv::uninitialized_copy_n(first + begin, end - begin, d_first + begin);
+        },
+        [&](std::size_t begin, std::size_t end) { pmv::destroy_n(d_first + begin, end - begin); });
+    return d_first + n;
+}
+
+// Same, the copies of each chunk allocating their heap objects with
+// allocator_for(chunk), called by the thread copying it. Giving each chunk
+// its own arena, like a std::pmr::monotonic_buffer_resource, lets threads
+// allocate without contending on a shared heap.
+template<typename Value, typename AllocatorFor>
+Value* parallel_uninitialized_copy_n(std::allocator_arg_t,
+                                     AllocatorFor&& allocator_for,
+                                     Value const* first,
+                                     std::size_t n,
+                                     Value* d_first,
+                                     std::size_t max_threads = detail::default_thread_count())
+{
+    detail::construct_in_chunks(
+        n,
+        max_threads,
+        [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            typename Value::allocator_type const alloc = allocator_for(chunk);
+            pmv::uninitialized_copy_n(
+                std::allocator_arg, alloc, first + begin, end - begin, d_first + begin);
+        },
+        [&](std::size_t begin, std::size_t end) { pmv::destroy_n(d_first + begin, end - begin); });
+    return d_first + n;
+}
+
+// Build the values f(first[i]) into uninitialized memory, like
+// std::uninitialized_transform would, in parallel chunks as above. f is
+// called concurrently.
+template<typename Value, typename Result, typename F>
+Result* parallel_uninitialized_transform_n(Value const* first,
+                                           std::size_t n,
+                                           Result* d_first,
+                                           F const& f,
+                                           std::size_t max_threads
+                                           = detail::default_thread_count())
+{
+    detail::construct_in_chunks(
+        n,
+        max_threads,
+        [&](std::size_t, std::size_t begin, std::size_t end) {
+            auto i = begin;
+            try {
+                for (; i < end; ++i) {
+                    new (d_first + i) Result(f(first[i]));
+                }
+            } catch (...) {
+                detail::destroy_objects(d_first + begin, i - begin);
+                throw;
+            }
+        },
+        [&](std::size_t begin, std::size_t end) {
+            detail::destroy_objects(d_first + begin, end - begin);
+        });
+    return d_first + n;
+}
+
+} // pmv
+
+#endif // PARALLEL_ALGORITHMS_INCLUDE_H
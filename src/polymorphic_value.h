@@ -1,95 +1,492 @@
 #ifndef POLYMORPHIC_VALUE_INCLUDE_H
 #define POLYMORPHIC_VALUE_INCLUDE_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <new>
 #include <type_traits>
 #include <utility>
 
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#define POLYMORPHIC_VALUE_PMR_SUPPORTED true
+#else
+#define POLYMORPHIC_VALUE_PMR_SUPPORTED false
+#endif
+
 #ifdef __cpp_rtti
 #include <stdexcept>
+#include <typeinfo>
 #define POLYMORPHIC_VALUE_RTTI_SUPPORTED true
 #else
 #define POLYMORPHIC_VALUE_RTTI_SUPPORTED false
 #endif
 
+// Constant evaluated virtual calls, destructors and std::construct_at, which
+// closed_polymorphic_value needs to be built at compile time
+#if defined(__cpp_constexpr_dynamic_alloc) && defined(__cpp_lib_constexpr_dynamic_alloc)
+#define POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED true
+#define POLYMORPHIC_VALUE_CONSTEXPR constexpr
+#else
+#define POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED false
+#define POLYMORPHIC_VALUE_CONSTEXPR
+#endif
+
+// Define to a non zero value to collect per type statistics, see type_statistics
+#ifndef POLYMORPHIC_VALUE_STATISTICS
+#define POLYMORPHIC_VALUE_STATISTICS 0
+#endif
+
+#if POLYMORPHIC_VALUE_STATISTICS
+#include <ostream>
+#endif
+
 namespace pmv {
+
+// Tells whether moving an object into new storage and destroying the source is
+// equivalent to copying its bytes. Specialize it for types known to be
+// trivially relocatable, like most types holding a std::unique_ptr, so that
+// they are moved with a memcpy.
+template<typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {
+};
+
+// Tells whether moving an object never throws. Objects whose move may throw
+// are stored in the heap, as values are moved by noexcept functions.
+// Specialize it for types whose move constructor and assignment never throw
+// but aren't declared noexcept, like some older types, so that they can be
+// stored locally. If their move throws anyway, std::terminate is called.
+template<typename T>
+struct is_nothrow_movable : std::is_nothrow_move_constructible<T> {
+};
+
+#if POLYMORPHIC_VALUE_STATISTICS
+
+struct type_statistics;
+
+namespace detail {
+
+// Head of the intrusive list of all type_statistics
+inline std::atomic<type_statistics*>& statistics_list() noexcept
+{
+    static std::atomic<type_statistics*> head{nullptr};
+    return head;
+}
+
+} // namespace detail
+
+// Counters of the operations done on the objects of a type. There is one
+// instance per vtable, and vtables are shared by values with the same SBO
+// alignment and allocator, so a type appears once for each alignment and
+// allocator it is used with, and whether it was stored locally or in the heap.
+struct type_statistics {
+    using counter = std::atomic<std::size_t>;
+
+    type_statistics(char const* name_,
+                    std::size_t size_,
+                    std::size_t alignment_,
+                    std::size_t sbo_alignment_,
+                    bool in_heap_) noexcept
+        : name{name_}
+        , size{size_}
+        , alignment{alignment_}
+        , sbo_alignment{sbo_alignment_}
+        , in_heap{in_heap_}
+        , next{detail::statistics_list().load()}
+    {
+        while (!detail::statistics_list().compare_exchange_weak(next, this)) {
+        }
+    }
+
+    // Implementation defined name of the type, null without RTTI
+    char const* const name;
+    std::size_t const size;
+    std::size_t const alignment;
+    std::size_t const sbo_alignment;
+    // Whether the objects don't fit in the SBO buffer
+    bool const in_heap;
+
+    // Objects constructed in local or heap storage, including copies and moves
+    // into an empty value
+    counter local_constructions{0};
+    counter heap_constructions{0};
+    // Copy constructions and assignments
+    counter copies{0};
+    // Move constructions and assignments, including relocations and stolen
+    // heap objects
+    counter moves{0};
+    // Assignments that replaced an object of another type with one of this type
+    counter cross_type_assignments{0};
+    counter bytes_allocated{0};
+
+    type_statistics* next;
+};
+
+#endif
+
+// Operations of the vtables reported to tracers
+enum class trace_operation {
+    destroy,
+    move,
+    move_construct,
+    move_assign,
+    copy_construct,
+    copy_assign,
+    destroy_n,
+    copy_n,
+    relocate_n
+};
+
+// What a tracer is told before and after an operation
+struct trace_event {
+    trace_operation operation;
+    // Implementation defined name of the type, null without RTTI
+    char const* type_name;
+    std::size_t size;
+    // Whether the objects are stored in the heap
+    bool in_heap;
+    // Objects the operation works on, more than one for the array operations
+    std::size_t count;
+};
+
+// Tracer of the values that don't trace their operations, see
+// default_policy::tracer
+struct no_tracer {
+};
+
 namespace detail {
 
+// Operations recorded in type_statistics
+enum class statistics_event { construction, copy, move, cross_type_assignment };
+
+// vtables are aligned to a cache line so that each one takes a single line.
+constexpr std::size_t vtable_alignment = 64;
+
+struct object_info;
+
 // All these function pointers assume that the source and destination objects
-// are the same type and that their storage type is the same.
+// are the same type and that their storage layout is the same. Storages are
+// passed as pointers to the sbo_storage, and objects as pointers to the object
+// itself. Storages without an allocator start with their buffer, so local
+// objects can also be passed as their storage. Hot operations go first.
 struct polymorphic_value_vtable {
     // Call destructor and free storage
-    void (*destroy)(void* ptr);
-    // Copy from another storage into an empty storage
-    void (*copy)(void const* src, void* dst);
-    // Copy from a non managed object into an empty storage
-    void (*copy_raw)(void const* src, void* dst);
-    // Move from another storage into an empty storage
+    void (*destroy)(void* storage);
+    // Move from another storage into an empty storage. Null if the storage can
+    // be relocated by copying its bytes.
     void (*move)(void* src, void* dst) noexcept;
-    // Move from a non managed object into an empty storage
-    void (*move_raw)(void* src, void* dst) noexcept;
-    // Copy from another storage into a storage containing an object
-    void (*copy_assign)(void const* src, void* dst);
-    // Copy from a non managed object into a storage containing an object
-    void (*copy_assign_raw)(void const* src, void* dst);
-    // Move from another storage into a storage containing an object
+    // Move from an object into an empty storage
+    void (*move_construct)(void* src, void* dst) noexcept;
+    // Move from an object into another object
     void (*move_assign)(void* src, void* dst) noexcept;
-    // Move from a non managed objet into a storage containing an object
-    void (*move_assign_raw)(void* src, void* dst) noexcept;
+    // Copy from an object into an empty storage
+    void (*copy_construct)(void const* src, void* dst);
+    // Copy from an object into another object
+    void (*copy_assign)(void const* src, void* dst);
+    // Cold properties of the stored type
+    object_info const* info;
+};
+
+// The heap vtable is preceded by a pointer, see get_vtable
+static_assert(sizeof(polymorphic_value_vtable) + sizeof(void*) <= vtable_alignment,
+              "vtable doesn't fit in a cache line");
+
+struct object_info {
+    std::size_t size;
+    std::size_t alignment;
+    // Copies never throw, which excludes heap objects
+    bool nothrow_copy;
+    // vtable storing the same type in the heap, for conversions to values where
+    // it doesn't fit. Null for moved from values.
+    polymorphic_value_vtable const* heap_vtable;
+    // Operations on n consecutive storages holding this type, stride bytes
+    // apart, see destroy_n
+    void (*destroy_n)(void* storage, std::size_t stride, std::size_t n);
+    void (*copy_n)(void const* src, void* dst, std::size_t stride, std::size_t n);
+    void (*relocate_n)(void* src, void* dst, std::size_t stride, std::size_t n) noexcept;
+#if POLYMORPHIC_VALUE_STATISTICS
+    // Null for moved from values
+    type_statistics* statistics;
+#endif
 };
 
 template<typename Derived, std::size_t SboSize, std::size_t SboAlignment>
 constexpr static auto store_in_heap
-    = !std::is_nothrow_move_constructible<std::decay_t<Derived>>::value || sizeof(Derived) > SboSize
+    = !is_nothrow_movable<std::decay_t<Derived>>::value || sizeof(Derived) > SboSize
     || alignof(Derived) > SboAlignment;
 
+// Holds the allocator used for heap stored objects. Empty allocators don't take
+// any space.
+template<typename Allocator,
+         bool Empty = std::is_empty<Allocator>::value && !std::is_final<Allocator>::value>
+struct allocator_holder : private Allocator {
+    explicit allocator_holder(Allocator const& alloc) noexcept : Allocator(alloc) {}
+    explicit allocator_holder(Allocator&& alloc) noexcept : Allocator(std::move(alloc)) {}
+
+    Allocator& allocator() noexcept { return *this; }
+    Allocator const& allocator() const noexcept { return *this; }
+};
+
+template<typename Allocator>
+struct allocator_holder<Allocator, false> {
+    explicit allocator_holder(Allocator const& alloc) noexcept : m_allocator(alloc) {}
+    explicit allocator_holder(Allocator&& alloc) noexcept : m_allocator(std::move(alloc)) {}
+
+    Allocator& allocator() noexcept { return m_allocator; }
+    Allocator const& allocator() const noexcept { return m_allocator; }
+
+private:
+    Allocator m_allocator;
+};
+
 template<std::size_t SboSize, std::size_t SboAlignment>
-struct sbo_storage {
+struct sbo_buffer {
+    union {
+        void* heap_buffer;
+        alignas(SboAlignment) std::array<char, SboSize> local_buffer;
+    };
+};
+
+// Layout shared by all the sbo_storages with the same alignment and allocator,
+// no matter their SBO size. vtables depend only on it, so values with
+// different SBO sizes share them and can exchange objects.
+template<std::size_t SboAlignment,
+         typename Allocator,
+         bool CopyOnWrite,
+         bool Copyable,
+         typename Tracer = no_tracer>
+struct storage_layout {
+    using allocator_type = Allocator;
+    using holder_t = allocator_holder<Allocator>;
+    using tracer = Tracer;
+    // Same layout, calling the storage functions without tracing them
+    using untraced = storage_layout<SboAlignment, Allocator, CopyOnWrite, Copyable>;
+
+    constexpr static auto sbo_alignment = SboAlignment;
+    // Heap objects live in a shared_block
+    constexpr static auto copy_on_write = CopyOnWrite;
+    // Objects are never copied, so they don't need to be copyable
+    constexpr static auto copyable = Copyable;
+    constexpr static bool traced = !std::is_same<Tracer, no_tracer>::value;
+
+    // The allocator goes first, followed by the buffer
+    constexpr static std::size_t buffer_alignment = alignof(sbo_buffer<1, SboAlignment>);
+    constexpr static std::size_t buffer_offset = std::is_empty<holder_t>::value
+        ? 0
+        : (sizeof(holder_t) + buffer_alignment - 1) / buffer_alignment * buffer_alignment;
+
+    static Allocator& allocator(void* storage) noexcept
+    {
+        return static_cast<holder_t*>(storage)->allocator();
+    }
+
+    static void* buffer(void* storage) noexcept
+    {
+        return static_cast<char*>(storage) + buffer_offset;
+    }
+
+    static void const* buffer(void const* storage) noexcept
+    {
+        return static_cast<char const*>(storage) + buffer_offset;
+    }
+
+    static void*& heap_buffer(void* storage) noexcept
+    {
+        return *static_cast<void**>(buffer(storage));
+    }
+};
+
+// Reference count of the objects shared by copy on write values
+using shared_count = std::atomic<std::size_t>;
+
+// Heap block of a copy on write object. The count is right before the object,
+// so it can be reached from the object address without knowing its type.
+template<typename Derived>
+struct shared_block {
+    constexpr static std::size_t object_offset
+        = (sizeof(shared_count) + alignof(Derived) - 1) / alignof(Derived) * alignof(Derived);
+
+    alignas(std::max(alignof(Derived), alignof(shared_count))) char
+        bytes[object_offset + sizeof(Derived)];
+
+    static shared_block* from_object(void* object) noexcept
+    {
+        return reinterpret_cast<shared_block*>(static_cast<char*>(object) - object_offset);
+    }
+};
+
+// Bytes allocated for a heap object of the given size and alignment, in a
+// shared_block for copy on write values
+constexpr std::size_t heap_block_size(std::size_t size,
+                                      std::size_t alignment,
+                                      bool copy_on_write) noexcept
+{
+    if (!copy_on_write) {
+        return size;
+    }
+    auto const object_offset = (sizeof(shared_count) + alignment - 1) / alignment * alignment;
+    auto const block_alignment = std::max(alignment, alignof(shared_count));
+    return (object_offset + size + block_alignment - 1) / block_alignment * block_alignment;
+}
+
+inline shared_count& get_shared_count(void const* object) noexcept
+{
+    return *reinterpret_cast<shared_count*>(const_cast<char*>(static_cast<char const*>(object))
+                                            - sizeof(shared_count));
+}
+
+namespace heap_storage {
+
+template<typename T, typename Layout>
+using allocator_traits = std::allocator_traits<typename std::allocator_traits<
+    typename Layout::allocator_type>::template rebind_alloc<T>>;
+
+template<typename Derived, typename Layout, typename... Args>
+inline Derived* create_unique(void* storage, Args&&... args)
+{
+    using traits = allocator_traits<Derived, Layout>;
+    static_assert(std::is_same<typename traits::pointer, Derived*>::value,
+                  "Fancy pointers are not supported");
+
+    typename traits::allocator_type alloc{Layout::allocator(storage)};
+    Derived* const ptr = traits::allocate(alloc, 1);
+    try {
+        new (ptr) Derived{std::forward<Args>(args)...};
+    } catch (...) {
+        traits::deallocate(alloc, ptr, 1);
+        throw;
+    }
+    return ptr;
+}
+
+template<typename Derived, typename Layout, typename... Args>
+inline Derived* create_shared(void* storage, Args&&... args)
+{
+    using block_t = shared_block<Derived>;
+    using traits = allocator_traits<block_t, Layout>;
+    static_assert(std::is_same<typename traits::pointer, block_t*>::value,
+                  "Fancy pointers are not supported");
+
+    typename traits::allocator_type alloc{Layout::allocator(storage)};
+    block_t* const block = traits::allocate(alloc, 1);
+    char* const object = block->bytes + block_t::object_offset;
+    try {
+        new (object) Derived{std::forward<Args>(args)...};
+    } catch (...) {
+        traits::deallocate(alloc, block, 1);
+        throw;
+    }
+    new (object - sizeof(shared_count)) shared_count{1};
+    return reinterpret_cast<Derived*>(object);
+}
+
+// Allocate and construct an object using the allocator held by the storage
+template<typename Derived, typename Layout, typename... Args>
+inline Derived* create(void* storage, Args&&... args)
+{
+    if (Layout::copy_on_write) {
+        return create_shared<Derived, Layout>(storage, std::forward<Args>(args)...);
+    } else {
+        return create_unique<Derived, Layout>(storage, std::forward<Args>(args)...);
+    }
+}
+
+} // namespace heap_storage
+
+// The allocator is the first base, see storage_layout
+template<std::size_t SboSize,
+         std::size_t SboAlignment,
+         typename Allocator,
+         bool CopyOnWrite = false,
+         bool Copyable = true,
+         typename Tracer = no_tracer>
+struct sbo_storage : allocator_holder<Allocator>, sbo_buffer<SboSize, SboAlignment> {
+    using allocator_type = Allocator;
+    using buffer_t = sbo_buffer<SboSize, SboAlignment>;
+    using layout = storage_layout<SboAlignment, Allocator, CopyOnWrite, Copyable, Tracer>;
+
     constexpr static auto sbo_size = SboSize;
     constexpr static auto sbo_alignment = SboAlignment;
+    constexpr static auto copy_on_write = CopyOnWrite;
+
+    explicit sbo_storage(Allocator const& alloc) noexcept : allocator_holder<Allocator>{alloc}
+    {
+        assert(layout::buffer(this) == static_cast<buffer_t*>(this));
+    }
+
+    explicit sbo_storage(Allocator&& alloc) noexcept
+        : allocator_holder<Allocator>{std::move(alloc)}
+    {
+        assert(layout::buffer(this) == static_cast<buffer_t*>(this));
+    }
 
     template<typename Derived, typename... Args>
     void build(Args&&... args) noexcept(!store_in_heap<Derived, sbo_size, sbo_alignment>&& noexcept(
         Derived{std::forward<Args>(args)...}))
     {
         if (store_in_heap<Derived, sbo_size, sbo_alignment>) {
-            this->heap_buffer = new Derived{std::forward<Args>(args)...};
+            this->heap_buffer
+                = heap_storage::create<Derived, layout>(this, std::forward<Args>(args)...);
         } else {
             new (this->local_buffer.data()) Derived{std::forward<Args>(args)...};
         }
     }
 
-    union {
-        void* heap_buffer;
-        alignas(SboAlignment) std::array<char, SboSize> local_buffer;
-    };
+    // Pointer to the stored object, for when its type is known
+    template<typename Derived>
+    Derived* get_as() noexcept
+    {
+        if (store_in_heap<Derived, sbo_size, sbo_alignment>) {
+            return static_cast<Derived*>(this->heap_buffer);
+        } else {
+            return reinterpret_cast<Derived*>(this->local_buffer.data());
+        }
+    }
+
+    // Take the object in src without calling any of its special functions
+    void relocate_from(sbo_storage& src) noexcept
+    {
+        std::memcpy(static_cast<buffer_t*>(this), static_cast<buffer_t*>(&src), sizeof(buffer_t));
+    }
 };
 
 namespace local_storage {
 
-// Local storage doesn't need different "raw_" prefixed functions.
-
-template<typename Derived>
-inline void destroy(void* ptr)
+template<typename Derived, typename Layout>
+inline void destroy(void* storage)
 {
-    static_cast<Derived*>(ptr)->~Derived();
+    static_cast<Derived*>(Layout::buffer(storage))->~Derived();
 }
 
-template<typename Derived>
+template<typename Derived, typename Layout>
 inline void copy(void const* src, void* dst)
 {
-    new (dst) Derived{*static_cast<Derived const*>(src)};
+    new (Layout::buffer(dst)) Derived{*static_cast<Derived const*>(src)};
 }
 
-template<typename Derived>
+template<typename Derived, typename Layout>
+inline void move_construct(void* src, void* dst) noexcept
+{
+    new (Layout::buffer(dst)) Derived{std::move(*static_cast<Derived*>(src))};
+}
+
+template<typename Derived, typename Layout>
 inline void move(void* src, void* dst) noexcept
 {
-    new (dst) Derived{std::move(*static_cast<Derived*>(src))};
+    move_construct<Derived, Layout>(Layout::buffer(src), dst);
 }
 
+} // namespace local_storage
+
+// Assignment works on the objects themselves, no matter where they are stored
+
 template<typename Derived>
 inline void copy_assign(void const* src, void* dst)
 {
@@ -102,282 +499,1099 @@ inline void move_assign(void* src, void* dst) noexcept
     *static_cast<Derived*>(dst) = std::move(*static_cast<Derived*>(src));
 }
 
-} // namespace local_storage
-
 namespace heap_storage {
 
-template<typename Derived>
-inline void destroy(void* ptr)
+template<typename Derived, typename Layout>
+inline void destroy_unique(void* storage)
 {
-    delete *static_cast<Derived**>(ptr);
-}
+    auto* const object = static_cast<Derived*>(Layout::heap_buffer(storage));
 
-template<typename Derived>
-inline void copy(void const* src, void* dst)
-{
-    *static_cast<Derived**>(dst) = new Derived{**static_cast<Derived const* const*>(src)};
+    using traits = allocator_traits<Derived, Layout>;
+    typename traits::allocator_type alloc{Layout::allocator(storage)};
+    object->~Derived();
+    traits::deallocate(alloc, object, 1);
 }
 
-template<typename Derived>
-inline void copy_raw(void const* src, void* dst)
+// Release a reference, destroying the object when it is the last one
+template<typename Derived, typename Layout>
+inline void destroy_shared(void* storage)
 {
-    *static_cast<Derived**>(dst) = new Derived{*static_cast<Derived const*>(src)};
+    auto* const object = static_cast<Derived*>(Layout::heap_buffer(storage));
+    auto& count = get_shared_count(object);
+    if (count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    using block_t = shared_block<Derived>;
+    using traits = allocator_traits<block_t, Layout>;
+    typename traits::allocator_type alloc{Layout::allocator(storage)};
+    object->~Derived();
+    count.~shared_count();
+    traits::deallocate(alloc, block_t::from_object(object), 1);
 }
 
-inline void move(void* src, void* dst) noexcept
+template<typename Derived, typename Layout>
+inline void destroy(void* storage)
 {
-    *static_cast<void**>(dst) = *static_cast<void**>(src);
-    *static_cast<void**>(src) = nullptr;
+    if (Layout::copy_on_write) {
+        destroy_shared<Derived, Layout>(storage);
+    } else {
+        destroy_unique<Derived, Layout>(storage);
+    }
 }
 
-template<typename Derived>
-inline void move_raw(void* src, void* dst) noexcept
+template<typename Derived, typename Layout>
+inline void copy(void const* src, void* dst)
 {
-    *static_cast<Derived**>(dst) = new Derived{std::move(*static_cast<Derived*>(src))};
+    Layout::heap_buffer(dst) = create<Derived, Layout>(dst, *static_cast<Derived const*>(src));
 }
 
-template<typename Derived>
-inline void copy_assign(void const* src, void* dst)
+template<typename Derived, typename Layout>
+inline void move(void* src, void* dst) noexcept
 {
-    **static_cast<Derived**>(dst) = **static_cast<Derived const* const*>(src);
+    Layout::heap_buffer(dst) = create<Derived, Layout>(dst, std::move(*static_cast<Derived*>(src)));
 }
 
-template<typename Derived>
-inline void copy_assign_raw(void const* src, void* dst)
+} // namespace heap_storage
+
+// Loops over storages holding objects of the same type, calling the storage
+// functions directly so that they can be inlined
+namespace bulk_storage {
+
+template<typename Derived, typename Layout, bool InHeap>
+inline void destroy_n(void* storage, std::size_t stride, std::size_t n)
 {
-    **static_cast<Derived**>(dst) = *static_cast<Derived const*>(src);
+    if (!InHeap && std::is_trivially_destructible<Derived>::value) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < n; ++i) {
+        auto* const s = static_cast<char*>(storage) + i * stride;
+        if (InHeap) {
+            heap_storage::destroy<Derived, Layout>(s);
+        } else {
+            local_storage::destroy<Derived, Layout>(s);
+        }
+    }
 }
 
-inline void move_assign(void* src, void* dst) noexcept
+template<typename Derived, typename Layout, bool InHeap>
+inline void copy_n(void const* src, void* dst, std::size_t stride, std::size_t n)
 {
-    std::swap(*static_cast<void**>(src), *static_cast<void**>(dst));
+    std::size_t i = 0;
+    try {
+        for (; i < n; ++i) {
+            auto const* const s = static_cast<char const*>(src) + i * stride;
+            auto* const d = static_cast<char*>(dst) + i * stride;
+            if (InHeap) {
+                heap_storage::copy<Derived, Layout>(
+                    *static_cast<void* const*>(Layout::buffer(s)), d);
+            } else {
+                local_storage::copy<Derived, Layout>(Layout::buffer(s), d);
+            }
+        }
+    } catch (...) {
+        destroy_n<Derived, Layout, InHeap>(dst, stride, i);
+        throw;
+    }
 }
 
-template<typename Derived>
-inline void move_assign_raw(void* src, void* dst) noexcept
+// Move the objects into the empty dst storages and destroy them in src
+template<typename Derived, typename Layout, bool InHeap>
+inline void relocate_n(void* src, void* dst, std::size_t stride, std::size_t n) noexcept
 {
-    **static_cast<Derived**>(dst) = std::move(*static_cast<Derived*>(src));
+    for (std::size_t i = 0; i < n; ++i) {
+        auto* const s = static_cast<char*>(src) + i * stride;
+        auto* const d = static_cast<char*>(dst) + i * stride;
+        if (InHeap || is_trivially_relocatable<Derived>::value) {
+            // Heap objects are stolen
+            std::memcpy(
+                Layout::buffer(d), Layout::buffer(s), InHeap ? sizeof(void*) : sizeof(Derived));
+        } else {
+            local_storage::move<Derived, Layout>(s, d);
+            local_storage::destroy<Derived, Layout>(s);
+        }
+    }
 }
 
-} // namespace heap_storage
-
-template<typename Derived,
-         typename Storage,
-         bool InHeap = store_in_heap<Derived, Storage::sbo_size, Storage::sbo_alignment>>
-struct get_vtable;
+} // namespace bulk_storage
 
-// vtable for local (SBO) storage
-template<typename Derived, typename Storage>
-struct get_vtable<Derived, Storage, false> {
-    static polymorphic_value_vtable const* get() noexcept
-    {
-        alignas(alignof(void*) * 2) static const polymorphic_value_vtable static_vtable{
-            local_storage::destroy<Derived>,
-            local_storage::copy<Derived>,
-            local_storage::copy<Derived>,
-            local_storage::move<Derived>,
-            local_storage::move<Derived>,
-            local_storage::copy_assign<Derived>,
-            local_storage::copy_assign<Derived>,
-            local_storage::move_assign<Derived>,
-            local_storage::move_assign<Derived>,
-        };
+namespace moved_from {
 
-        return &static_vtable;
-    }
-};
+// A relocated object leaves nothing behind, so all the operations on a moved
+// from value are no-ops.
 
-// vtable for heap storage
-template<typename Derived, typename Storage>
-struct get_vtable<Derived, Storage, true> {
-    static polymorphic_value_vtable const* get() noexcept
-    {
-        // Struct to align the vtable itself to odd alignof(void*) addresses. This
-        // is accomplished by aligning the whole structure to (alignof(void*) * 2)
-        // and putting a dummy void* in front of it.
-        struct odd_aligned_vtable {
-            void* dummy;
-            polymorphic_value_vtable vtable;
-        };
-
-        alignas(alignof(void*) * 2) static const odd_aligned_vtable static_vtable{
-            {},
-            {
-                heap_storage::destroy<Derived>,
-                heap_storage::copy<Derived>,
-                heap_storage::copy_raw<Derived>,
-                heap_storage::move,
-                heap_storage::move_raw<Derived>,
-                heap_storage::copy_assign<Derived>,
-                heap_storage::copy_assign_raw<Derived>,
-                heap_storage::move_assign,
-                heap_storage::move_assign_raw<Derived>,
-            }};
-
-        // Ensure that the address of the returned object is aligned to odd
-        // alignof(void*) addresses, as we rely on that to signal a "heap stored"
-        // value.
-        static_assert(offsetof(odd_aligned_vtable, vtable) == alignof(void*),
-                      "Bug: misaligned vtable");
-
-        return &static_vtable.vtable;
-    }
-};
+inline void destroy(void*) {}
+inline void copy(void const*, void*) {}
+inline void move(void*, void*) noexcept {}
+inline void destroy_n(void*, std::size_t, std::size_t) {}
+inline void copy_n(void const*, void*, std::size_t, std::size_t) {}
+inline void relocate_n(void*, void*, std::size_t, std::size_t) noexcept {}
 
-} // namespace detail
+} // namespace moved_from
 
-#if __cplusplus < 201703L
+// vtable for values whose object was relocated into another value. A template
+// so that its static members can be defined in the header.
+template<typename = void>
+struct moved_from_vtable {
+    static const object_info info;
+    alignas(vtable_alignment) static const polymorphic_value_vtable value;
+};
 
+// An empty object fits in any storage
 template<typename T>
-struct in_place_type_t {
-    explicit in_place_type_t() = default;
+const object_info moved_from_vtable<T>::info{
+    0,
+    1,
+    true,
+    nullptr,
+    moved_from::destroy_n,
+    moved_from::copy_n,
+    moved_from::relocate_n,
+#if POLYMORPHIC_VALUE_STATISTICS
+    nullptr,
+#endif
 };
 
 template<typename T>
-constexpr in_place_type_t<T> in_place_type{};
+alignas(vtable_alignment) const polymorphic_value_vtable moved_from_vtable<T>::value{
+    moved_from::destroy,
+    moved_from::move,
+    moved_from::move,
+    moved_from::move,
+    moved_from::copy,
+    moved_from::copy,
+    &info,
+};
+
+constexpr polymorphic_value_vtable const* get_moved_from_vtable() noexcept
+{
+    return &moved_from_vtable<>::value;
+}
+
+#if POLYMORPHIC_VALUE_STATISTICS
+template<typename Derived, typename Layout, bool InHeap>
+struct statistics_for {
+    static type_statistics value;
+};
 
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+template<typename Derived, typename Layout, bool InHeap>
+type_statistics statistics_for<Derived, Layout, InHeap>::value{
+    typeid(Derived).name(), sizeof(Derived), alignof(Derived), Layout::sbo_alignment, InHeap};
 #else
+template<typename Derived, typename Layout, bool InHeap>
+type_statistics statistics_for<Derived, Layout, InHeap>::value{
+    nullptr, sizeof(Derived), alignof(Derived), Layout::sbo_alignment, InHeap};
+#endif
+#endif
 
-template<typename T>
-using in_place_type_t = std::in_place_type_t<T>;
+template<typename Derived, typename Layout, bool InHeap>
+struct vtable_for;
+
+// Copy entries of the vtables. They are null for move only values, so that
+// the copy functions, which wouldn't compile, are never instantiated.
+template<typename Derived, typename Layout, bool InHeap, bool Copyable = Layout::copyable>
+struct copy_functions {
+    constexpr static void (*copy_construct)(void const*, void*)
+        = InHeap ? heap_storage::copy<Derived, Layout> : local_storage::copy<Derived, Layout>;
+    constexpr static void (*copy_assign)(void const*, void*) = detail::copy_assign<Derived>;
+    constexpr static void (*copy_n)(void const*, void*, std::size_t, std::size_t)
+        = bulk_storage::copy_n<Derived, Layout, InHeap>;
+};
 
-template<typename T>
-constexpr std::in_place_type_t<T> in_place_type{};
+template<typename Derived, typename Layout, bool InHeap>
+struct copy_functions<Derived, Layout, InHeap, false> {
+    constexpr static void (*copy_construct)(void const*, void*) = nullptr;
+    constexpr static void (*copy_assign)(void const*, void*) = nullptr;
+    constexpr static void (*copy_n)(void const*, void*, std::size_t, std::size_t) = nullptr;
+};
 
-#endif
+// Functions of the vtables of a Derived, stored locally or in the heap. The
+// ones of traced layouts call the functions of the untraced layout between
+// the hooks of the tracer, so values without a tracer have the same vtables
+// as if tracing didn't exist. Null entries stay null.
+template<typename Derived, typename Layout, bool InHeap, bool Traced = Layout::traced>
+struct vtable_entries;
+
+template<typename Derived, typename Layout>
+struct vtable_entries<Derived, Layout, false, false> : copy_functions<Derived, Layout, false> {
+    constexpr static void (*destroy)(void*) = local_storage::destroy<Derived, Layout>;
+    constexpr static void (*move)(void*, void*) noexcept
+        = is_trivially_relocatable<Derived>::value ? nullptr : local_storage::move<Derived, Layout>;
+    constexpr static void (*move_construct)(void*, void*) noexcept
+        = local_storage::move_construct<Derived, Layout>;
+    constexpr static void (*move_assign)(void*, void*) noexcept = detail::move_assign<Derived>;
+    constexpr static void (*destroy_n)(void*, std::size_t, std::size_t)
+        = bulk_storage::destroy_n<Derived, Layout, false>;
+    constexpr static void (*relocate_n)(void*, void*, std::size_t, std::size_t) noexcept
+        = bulk_storage::relocate_n<Derived, Layout, false>;
+};
 
-#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
-struct bad_polymorphic_value : public std::logic_error {
-    using logic_error::logic_error;
+template<typename Derived, typename Layout>
+struct vtable_entries<Derived, Layout, true, false> : copy_functions<Derived, Layout, true> {
+    constexpr static void (*destroy)(void*) = heap_storage::destroy<Derived, Layout>;
+    // Heap objects are relocated by copying the pointer
+    constexpr static void (*move)(void*, void*) noexcept = nullptr;
+    constexpr static void (*move_construct)(void*, void*) noexcept
+        = heap_storage::move<Derived, Layout>;
+    constexpr static void (*move_assign)(void*, void*) noexcept = detail::move_assign<Derived>;
+    constexpr static void (*destroy_n)(void*, std::size_t, std::size_t)
+        = bulk_storage::destroy_n<Derived, Layout, true>;
+    constexpr static void (*relocate_n)(void*, void*, std::size_t, std::size_t) noexcept
+        = bulk_storage::relocate_n<Derived, Layout, true>;
 };
+
+template<typename T>
+inline char const* type_name() noexcept
+{
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    return typeid(T).name();
+#else
+    return nullptr;
 #endif
+}
 
-namespace detail {
+template<typename Derived, typename Layout, bool InHeap>
+struct traced_functions {
+    using tracer = typename Layout::tracer;
+    using untraced = vtable_entries<Derived, typename Layout::untraced, InHeap>;
+
+    // Calls the hooks of the tracer around an operation, even if it throws
+    class scope {
+    public:
+        scope(trace_operation operation, std::size_t count) noexcept
+            : m_event{operation, type_name<Derived>(), sizeof(Derived), InHeap, count}
+        {
+            tracer::begin(m_event);
+        }
 
-template<typename Base, bool AllowAllocations, std::size_t SboSize, std::size_t SboAlignment>
-class polymorphic_value_impl {
-    static_assert(std::is_polymorphic<Base>::value, "Class is not polymorphic");
+        scope(scope const&) = delete;
+        scope& operator=(scope const&) = delete;
 
-    using storage_t = detail::sbo_storage<SboSize, SboAlignment>;
+        ~scope() { tracer::end(m_event); }
 
-public:
-    template<typename Derived,
-             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
-    polymorphic_value_impl(Derived&& d) noexcept(!POLYMORPHIC_VALUE_RTTI_SUPPORTED&& noexcept(
-        m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d))))
+    private:
+        trace_event m_event;
+    };
+
+    static void destroy(void* storage)
     {
-        static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
-                      "Allocations are not allowed");
-#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
-        if (typeid(std::decay_t<Derived>) != typeid(d)) {
-            throw bad_polymorphic_value{"Value would slice"};
-        }
-#endif
-        m_vtable = detail::get_vtable<std::decay_t<Derived>, storage_t>::get();
-        m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d));
+        scope s{trace_operation::destroy, 1};
+        untraced::destroy(storage);
     }
 
-    template<typename Derived,
-             typename... Args,
-             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
-    explicit polymorphic_value_impl(in_place_type_t<Derived>, Args&&... args) noexcept(
-        noexcept(m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...)))
+    static void move(void* src, void* dst) noexcept
     {
-        static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
-                      "Allocations are not allowed");
-        m_vtable = detail::get_vtable<std::decay_t<Derived>, storage_t>::get();
-        m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...);
+        scope s{trace_operation::move, 1};
+        untraced::move(src, dst);
     }
 
-    polymorphic_value_impl(polymorphic_value_impl const& src) : m_vtable{src.m_vtable}
+    static void move_construct(void* src, void* dst) noexcept
     {
-        m_vtable->copy(&src.m_storage, &m_storage);
+        scope s{trace_operation::move_construct, 1};
+        untraced::move_construct(src, dst);
     }
 
-    polymorphic_value_impl(polymorphic_value_impl&& src) noexcept : m_vtable{src.m_vtable}
+    static void move_assign(void* src, void* dst) noexcept
     {
-        m_vtable->move(&src.m_storage, &m_storage);
+        scope s{trace_operation::move_assign, 1};
+        untraced::move_assign(src, dst);
     }
 
-    polymorphic_value_impl& operator=(polymorphic_value_impl const& src)
+    static void copy_construct(void const* src, void* dst)
     {
-        if (&src == this) {
-            return *this;
-        }
-
-        if (m_vtable == src.m_vtable) {
-            m_vtable->copy_assign(&src.m_storage, &m_storage);
-        } else {
-            m_vtable->destroy(&m_storage);
-            m_vtable = src.m_vtable;
-            m_vtable->copy(&src.m_storage, &m_storage);
-        }
+        scope s{trace_operation::copy_construct, 1};
+        untraced::copy_construct(src, dst);
+    }
 
-        return *this;
+    static void copy_assign(void const* src, void* dst)
+    {
+        scope s{trace_operation::copy_assign, 1};
+        untraced::copy_assign(src, dst);
     }
 
-    polymorphic_value_impl& operator=(polymorphic_value_impl&& src) noexcept
+    static void destroy_n(void* storage, std::size_t stride, std::size_t n)
     {
-        if (&src == this) {
-            return *this;
-        }
+        scope s{trace_operation::destroy_n, n};
+        untraced::destroy_n(storage, stride, n);
+    }
 
-        if (m_vtable == src.m_vtable) {
-            m_vtable->move_assign(&src.m_storage, &m_storage);
+    static void copy_n(void const* src, void* dst, std::size_t stride, std::size_t n)
+    {
+        scope s{trace_operation::copy_n, n};
+        untraced::copy_n(src, dst, stride, n);
+    }
+
+    static void relocate_n(void* src, void* dst, std::size_t stride, std::size_t n) noexcept
+    {
+        scope s{trace_operation::relocate_n, n};
+        untraced::relocate_n(src, dst, stride, n);
+    }
+};
+
+template<typename Derived, typename Layout, bool InHeap>
+struct vtable_entries<Derived, Layout, InHeap, true> {
+    using traced = traced_functions<Derived, Layout, InHeap>;
+
+    constexpr static void (*destroy)(void*) = traced::destroy;
+    constexpr static void (*move)(void*, void*) noexcept
+        = InHeap || is_trivially_relocatable<Derived>::value ? nullptr : traced::move;
+    constexpr static void (*move_construct)(void*, void*) noexcept = traced::move_construct;
+    constexpr static void (*move_assign)(void*, void*) noexcept = traced::move_assign;
+    constexpr static void (*copy_construct)(void const*, void*)
+        = Layout::copyable ? traced::copy_construct : nullptr;
+    constexpr static void (*copy_assign)(void const*, void*)
+        = Layout::copyable ? traced::copy_assign : nullptr;
+    constexpr static void (*destroy_n)(void*, std::size_t, std::size_t) = traced::destroy_n;
+    constexpr static void (*copy_n)(void const*, void*, std::size_t, std::size_t)
+        = Layout::copyable ? traced::copy_n : nullptr;
+    constexpr static void (*relocate_n)(void*, void*, std::size_t, std::size_t) noexcept
+        = traced::relocate_n;
+};
+
+// Static members, like the vtables, so that their addresses are constant
+// expressions, which keeps them all constant initialized
+template<typename Derived, typename Layout, bool InHeap>
+struct object_info_for {
+    static const object_info value;
+};
+
+template<typename Derived, typename Layout, bool InHeap>
+const object_info object_info_for<Derived, Layout, InHeap>::value{
+    sizeof(Derived),
+    alignof(Derived),
+    !InHeap && std::is_nothrow_copy_constructible<Derived>::value,
+    vtable_for<Derived, Layout, true>::get(),
+    vtable_entries<Derived, Layout, InHeap>::destroy_n,
+    vtable_entries<Derived, Layout, InHeap>::copy_n,
+    vtable_entries<Derived, Layout, InHeap>::relocate_n,
+#if POLYMORPHIC_VALUE_STATISTICS
+    &statistics_for<Derived, Layout, InHeap>::value,
+#endif
+};
+
+inline void record(polymorphic_value_vtable const* vtable, statistics_event event) noexcept
+{
+#if POLYMORPHIC_VALUE_STATISTICS
+    auto* const statistics = vtable->info->statistics;
+    if (!statistics) {
+        return;
+    }
+
+    constexpr auto order = std::memory_order_relaxed;
+    switch (event) {
+    case statistics_event::construction:
+        if (statistics->in_heap) {
+            statistics->heap_constructions.fetch_add(1, order);
+            statistics->bytes_allocated.fetch_add(statistics->size, order);
         } else {
-            m_vtable->destroy(&m_storage);
-            m_vtable = src.m_vtable;
-            m_vtable->move(&src.m_storage, &m_storage);
+            statistics->local_constructions.fetch_add(1, order);
         }
+        break;
+    case statistics_event::copy:
+        statistics->copies.fetch_add(1, order);
+        break;
+    case statistics_event::move:
+        statistics->moves.fetch_add(1, order);
+        break;
+    case statistics_event::cross_type_assignment:
+        statistics->cross_type_assignments.fetch_add(1, order);
+        break;
+    }
+#else
+    (void)vtable;
+    (void)event;
+#endif
+}
 
-        return *this;
+// vtable for local (SBO) storage. The vtables are static members rather than
+// function local statics, so their addresses are link time constants that
+// values are built with and compared to without calling get().
+template<typename Derived, typename Layout>
+struct vtable_for<Derived, Layout, false> {
+    alignas(vtable_alignment) static const polymorphic_value_vtable value;
+
+    constexpr static polymorphic_value_vtable const* get() noexcept { return &value; }
+};
+
+template<typename Derived, typename Layout>
+alignas(vtable_alignment) const polymorphic_value_vtable vtable_for<Derived, Layout, false>::value{
+    vtable_entries<Derived, Layout, false>::destroy,
+    vtable_entries<Derived, Layout, false>::move,
+    vtable_entries<Derived, Layout, false>::move_construct,
+    vtable_entries<Derived, Layout, false>::move_assign,
+    vtable_entries<Derived, Layout, false>::copy_construct,
+    vtable_entries<Derived, Layout, false>::copy_assign,
+    &object_info_for<Derived, Layout, false>::value,
+};
+
+// Struct to align the vtable itself to odd alignof(void*) addresses. This is
+// accomplished by aligning the whole structure to vtable_alignment, which is a
+// multiple of (alignof(void*) * 2), and putting a dummy void* in front of it.
+struct odd_aligned_vtable {
+    void* dummy;
+    polymorphic_value_vtable vtable;
+};
+
+// Ensure that the address of the vtable is aligned to odd alignof(void*)
+// addresses, as we rely on that to signal a "heap stored" value.
+static_assert(offsetof(odd_aligned_vtable, vtable) == alignof(void*), "Bug: misaligned vtable");
+
+// vtable for heap storage
+template<typename Derived, typename Layout>
+struct vtable_for<Derived, Layout, true> {
+    alignas(vtable_alignment) static const odd_aligned_vtable value;
+
+    constexpr static polymorphic_value_vtable const* get() noexcept { return &value.vtable; }
+};
+
+template<typename Derived, typename Layout>
+alignas(vtable_alignment) const odd_aligned_vtable vtable_for<Derived, Layout, true>::value{
+    {},
+    {
+        vtable_entries<Derived, Layout, true>::destroy,
+        vtable_entries<Derived, Layout, true>::move,
+        vtable_entries<Derived, Layout, true>::move_construct,
+        vtable_entries<Derived, Layout, true>::move_assign,
+        vtable_entries<Derived, Layout, true>::copy_construct,
+        vtable_entries<Derived, Layout, true>::copy_assign,
+        &object_info_for<Derived, Layout, true>::value,
+    }};
+
+// vtable of a Derived stored in a Storage
+template<typename Derived,
+         typename Storage,
+         bool InHeap = store_in_heap<Derived, Storage::sbo_size, Storage::sbo_alignment>>
+struct get_vtable : vtable_for<Derived, typename Storage::layout, InHeap> {
+};
+
+} // namespace detail
+
+#if __cplusplus < 201703L
+
+template<typename T>
+struct in_place_type_t {
+    explicit in_place_type_t() = default;
+};
+
+template<typename T>
+constexpr in_place_type_t<T> in_place_type{};
+
+#else
+
+template<typename T>
+using in_place_type_t = std::in_place_type_t<T>;
+
+template<typename T>
+constexpr std::in_place_type_t<T> in_place_type{};
+
+#endif
+
+#if POLYMORPHIC_VALUE_STATISTICS
+
+// Call f with the type_statistics of every type stored so far, including the
+// ones without any recorded operation
+template<typename F>
+void for_each_type_statistics(F&& f)
+{
+    for (auto* statistics = detail::statistics_list().load(); statistics;
+         statistics = statistics->next) {
+        f(static_cast<type_statistics const&>(*statistics));
     }
+}
 
-    template<typename Derived, std::enable_if_t<std::is_base_of<Base, Derived>::value, bool> = true>
-    polymorphic_value_impl& operator=(Derived const& src)
+inline void reset_statistics() noexcept
+{
+    for (auto* statistics = detail::statistics_list().load(); statistics;
+         statistics = statistics->next) {
+        statistics->local_constructions = 0;
+        statistics->heap_constructions = 0;
+        statistics->copies = 0;
+        statistics->moves = 0;
+        statistics->cross_type_assignments = 0;
+        statistics->bytes_allocated = 0;
+    }
+}
+
+// Write one line of key=value pairs per type with recorded operations
+inline void dump_statistics(std::ostream& os)
+{
+    for_each_type_statistics([&os](type_statistics const& s) {
+        auto const local = s.local_constructions.load();
+        auto const heap = s.heap_constructions.load();
+        auto const copies = s.copies.load();
+        auto const moves = s.moves.load();
+        auto const cross_type = s.cross_type_assignments.load();
+        if (!local && !heap && !copies && !moves && !cross_type) {
+            return;
+        }
+
+        os << (s.name ? s.name : "<unknown>") << " size=" << s.size << " alignment=" << s.alignment
+           << " sbo_alignment=" << s.sbo_alignment
+           << " storage=" << (s.in_heap ? "heap" : "local") << " local_constructions=" << local
+           << " heap_constructions=" << heap << " copies=" << copies << " moves=" << moves
+           << " cross_type_assignments=" << cross_type
+           << " bytes_allocated=" << s.bytes_allocated.load() << '\n';
+    });
+}
+
+#endif
+
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+struct bad_polymorphic_value : public std::logic_error {
+    using logic_error::logic_error;
+};
+#endif
+
+// Tag to skip the slicing check when storing an object whose dynamic type is
+// known to be its static type. The check is still asserted in debug builds.
+struct unchecked_t {
+    explicit unchecked_t() = default;
+};
+
+constexpr unchecked_t unchecked{};
+
+// Compile time options of polymorphic_value. To change some of them, derive
+// from this class and redeclare them.
+struct default_policy {
+    // Keep a pointer to the stored object so that operator-> is a single load
+    // instead of a branch on the storage type, at the cost of one more pointer
+    // per value.
+    constexpr static bool cache_object_pointer = false;
+
+    // Share heap stored objects between copies, with an atomic reference
+    // count, until one of them is accessed through a non const operator-> or
+    // operator*. Copies of large objects become a count increment, but non
+    // const access may allocate and throw.
+    constexpr static bool copy_on_write = false;
+
+    // Values can be copied, which requires all the stored types to be copy
+    // constructible and assignable. Move only values store move only types,
+    // like the ones holding a std::unique_ptr, and leave the copy entries of
+    // their vtables null.
+    constexpr static bool copyable = true;
+
+    // Assignments and emplace replacing the object by one of another type
+    // leave the value unchanged if building the new object throws, instead of
+    // leaving it moved from. The new object is built in a temporary storage,
+    // on the stack, and then relocated, so it costs a move of local objects
+    // that may throw on copy and no additional allocation. Assignments between
+    // objects of the same type have the guarantee of their assignment operator.
+    constexpr static bool strong_exception_safety = false;
+
+    // Declare the vtable pointer before the storage instead of after it. The
+    // size of the value doesn't change, but the vtable pointer, loaded by
+    // every operation, shares the first cache line of the value with the
+    // start of the object and with the allocator.
+    constexpr static bool vtable_first = false;
+
+    // Class whose static begin(trace_event const&) noexcept and
+    // end(trace_event const&) noexcept are called before and after each
+    // operation going through the vtable, like copies, moves and destruction,
+    // even when it throws. Operations done without the vtable, like
+    // relocations by copying bytes, aren't reported. The vtables of values
+    // without tracer don't change.
+    using tracer = no_tracer;
+};
+
+struct cached_pointer_policy : default_policy {
+    constexpr static bool cache_object_pointer = true;
+};
+
+struct copy_on_write_policy : default_policy {
+    constexpr static bool copy_on_write = true;
+};
+
+struct move_only_policy : default_policy {
+    constexpr static bool copyable = false;
+};
+
+struct strong_exception_safety_policy : default_policy {
+    constexpr static bool strong_exception_safety = true;
+};
+
+struct vtable_first_policy : default_policy {
+    constexpr static bool vtable_first = true;
+};
+
+namespace detail {
+
+// Parameter of the copy operations of move only values. They are then not
+// copy operations, so the implicit ones are deleted.
+struct not_copyable {
+    explicit not_copyable() = default;
+};
+
+// Tag of the constructor of values without an object, see bulk_operations
+struct moved_from_t {
+    explicit moved_from_t() = default;
+};
+
+template<typename Value>
+struct bulk_operations;
+
+template<typename Value>
+struct type_keys;
+
+// Data members of a value, in the order chosen by Policy::vtable_first
+template<typename Storage, bool VtableFirst>
+struct value_fields {
+    template<typename Alloc>
+    explicit value_fields(Alloc&& alloc) noexcept : m_storage{std::forward<Alloc>(alloc)}
+    {
+    }
+
+    template<typename Alloc>
+    value_fields(Alloc&& alloc, polymorphic_value_vtable const* vtable) noexcept
+        : m_storage{std::forward<Alloc>(alloc)}
+        , m_vtable{vtable}
+    {
+    }
+
+    Storage m_storage;
+    polymorphic_value_vtable const* m_vtable;
+};
+
+template<typename Storage>
+struct value_fields<Storage, true> {
+    template<typename Alloc>
+    explicit value_fields(Alloc&& alloc) noexcept : m_storage{std::forward<Alloc>(alloc)}
+    {
+    }
+
+    template<typename Alloc>
+    value_fields(Alloc&& alloc, polymorphic_value_vtable const* vtable) noexcept
+        : m_vtable{vtable}
+        , m_storage{std::forward<Alloc>(alloc)}
+    {
+    }
+
+    polymorphic_value_vtable const* m_vtable;
+    Storage m_storage;
+};
+
+template<typename Base, bool Enabled>
+struct object_pointer_cache {
+    void set_object_pointer(Base*) noexcept {}
+};
+
+template<typename Base>
+struct object_pointer_cache<Base, true> {
+    void set_object_pointer(Base* ptr) noexcept { m_object = ptr; }
+
+    Base* m_object;
+};
+
+// Objects of final types can't be sliced, so they are never checked
+template<typename Derived>
+constexpr static auto may_slice
+    = POLYMORPHIC_VALUE_RTTI_SUPPORTED && !std::is_final<std::decay_t<Derived>>::value;
+
+// std::type_info can't be compared in constant expressions, so objects built
+// at compile time aren't checked for slicing
+POLYMORPHIC_VALUE_CONSTEXPR inline bool constant_evaluated() noexcept
+{
+#if POLYMORPHIC_VALUE_CONSTEXPR_SUPPORTED
+    return std::is_constant_evaluated();
+#else
+    return false;
+#endif
+}
+
+// Throw if d isn't exactly a Derived, returns d
+template<typename Derived, typename T>
+POLYMORPHIC_VALUE_CONSTEXPR inline T&& check_slicing(T&& d)
+{
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    if (may_slice<Derived> && !constant_evaluated() && typeid(std::decay_t<Derived>) != typeid(d)) {
+        throw bad_polymorphic_value{"Value would slice"};
+    }
+#endif
+    return std::forward<T>(d);
+}
+
+template<typename Derived, typename T>
+POLYMORPHIC_VALUE_CONSTEXPR inline void assert_no_slicing(T const& d) noexcept
+{
+#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
+    assert(!may_slice<Derived> || constant_evaluated()
+           || typeid(std::decay_t<Derived>) == typeid(d));
+#endif
+    (void)d;
+}
+
+template<typename Base,
+         bool AllowAllocations,
+         std::size_t SboSize,
+         std::size_t SboAlignment,
+         typename Allocator,
+         typename Policy>
+class polymorphic_value_impl
+    : private detail::object_pointer_cache<Base, Policy::cache_object_pointer>
+    , private detail::value_fields<detail::sbo_storage<SboSize,
+                                                       SboAlignment,
+                                                       Allocator,
+                                                       Policy::copy_on_write,
+                                                       Policy::copyable,
+                                                       typename Policy::tracer>,
+                                   Policy::vtable_first> {
+    static_assert(std::is_polymorphic<Base>::value, "Class is not polymorphic");
+
+    static_assert(Policy::copyable || !Policy::copy_on_write, "Copy on write values are copied");
+
+    using storage_t = detail::sbo_storage<SboSize,
+                                          SboAlignment,
+                                          Allocator,
+                                          Policy::copy_on_write,
+                                          Policy::copyable,
+                                          typename Policy::tracer>;
+    using fields_t = detail::value_fields<storage_t, Policy::vtable_first>;
+    using fields_t::m_storage;
+    using fields_t::m_vtable;
+    using allocator_traits_t = std::allocator_traits<Allocator>;
+    using cache_object_pointer_t = std::integral_constant<bool, Policy::cache_object_pointer>;
+
+    // Values that can be converted to this one
+    template<bool OtherAllowAllocations, std::size_t OtherSboSize>
+    using compatible_t = polymorphic_value_impl<Base,
+                                                OtherAllowAllocations,
+                                                OtherSboSize,
+                                                SboAlignment,
+                                                Allocator,
+                                                Policy>;
+
+    template<typename, bool, std::size_t, std::size_t, typename, typename>
+    friend class polymorphic_value_impl;
+
+    using copy_source_t
+        = std::conditional_t<Policy::copyable, polymorphic_value_impl, detail::not_copyable>;
+
+    template<typename>
+    friend struct detail::bulk_operations;
+
+    template<typename>
+    friend struct detail::type_keys;
+
+public:
+    using allocator_type = Allocator;
+    using policy_type = Policy;
+
+    constexpr static auto allow_allocations = AllowAllocations;
+    constexpr static auto sbo_size = SboSize;
+    constexpr static auto sbo_alignment = SboAlignment;
+
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    polymorphic_value_impl(Derived&& d) noexcept(!detail::may_slice<Derived>&& noexcept(
+        m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d))))
+        : polymorphic_value_impl(std::allocator_arg, Allocator{}, std::forward<Derived>(d))
+    {
+    }
+
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    polymorphic_value_impl(std::allocator_arg_t, Allocator const& alloc, Derived&& d) noexcept(
+        !detail::may_slice<Derived>&& noexcept(
+            m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d))))
+        : polymorphic_value_impl(std::allocator_arg,
+                                 alloc,
+                                 unchecked,
+                                 detail::check_slicing<Derived>(std::forward<Derived>(d)))
+    {
+    }
+
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    polymorphic_value_impl(unchecked_t, Derived&& d) noexcept(
+        noexcept(m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d))))
+        : polymorphic_value_impl(
+            std::allocator_arg, Allocator{}, unchecked, std::forward<Derived>(d))
+    {
+    }
+
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    polymorphic_value_impl(
+        std::allocator_arg_t,
+        Allocator const& alloc,
+        unchecked_t,
+        Derived&& d) noexcept(noexcept(m_storage.template build<std::decay_t<Derived>>(
+        std::forward<Derived>(d))))
+        : fields_t{alloc}
     {
         static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
                       "Allocations are not allowed");
-#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
-        if (typeid(std::decay_t<Derived>) != typeid(src)) {
-            throw bad_polymorphic_value{"Value would slice"};
+        detail::assert_no_slicing<Derived>(d);
+        m_vtable = detail::get_vtable<std::decay_t<Derived>, storage_t>::get();
+        m_storage.template build<std::decay_t<Derived>>(std::forward<Derived>(d));
+        update_object_pointer();
+        record(detail::statistics_event::construction);
+    }
+
+    template<typename Derived,
+             typename... Args,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    explicit polymorphic_value_impl(in_place_type_t<Derived>, Args&&... args) noexcept(
+        noexcept(m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...)))
+        : polymorphic_value_impl(
+            std::allocator_arg, Allocator{}, in_place_type<Derived>, std::forward<Args>(args)...)
+    {
+    }
+
+    template<typename Derived,
+             typename... Args,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    explicit polymorphic_value_impl(
+        std::allocator_arg_t,
+        Allocator const& alloc,
+        in_place_type_t<Derived>,
+        Args&&... args) noexcept(noexcept(m_storage.template build<std::decay_t<Derived>>(
+        std::forward<Args>(args)...)))
+        : fields_t{alloc}
+    {
+        static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
+                      "Allocations are not allowed");
+        m_vtable = detail::get_vtable<std::decay_t<Derived>, storage_t>::get();
+        m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...);
+        update_object_pointer();
+        record(detail::statistics_event::construction);
+    }
+
+    polymorphic_value_impl(copy_source_t const& src)
+        : polymorphic_value_impl(
+            std::allocator_arg,
+            allocator_traits_t::select_on_container_copy_construction(src.get_allocator()),
+            src)
+    {
+    }
+
+    polymorphic_value_impl(std::allocator_arg_t,
+                           Allocator const& alloc,
+                           copy_source_t const& src)
+        : fields_t{alloc, src.m_vtable}
+    {
+        if (can_share(src)) {
+            share_from(src);
+        } else {
+            m_vtable->copy_construct(src.get_object(), &m_storage);
+            record(detail::statistics_event::construction);
         }
-#endif
-        auto* new_vtable = detail::get_vtable<Derived, storage_t>::get();
+        update_object_pointer();
+        record(detail::statistics_event::copy);
+    }
+
+    polymorphic_value_impl(polymorphic_value_impl&& src) noexcept
+        : fields_t{std::move(src.m_storage.allocator()), src.m_vtable}
+    {
+        move_from(src);
+        update_object_pointer();
+    }
 
-        if (m_vtable == new_vtable) {
-            m_vtable->copy_assign_raw(&src, &m_storage);
+    // Conversions from values with another SBO size. Objects are copied or
+    // relocated into the buffer when they fit, and allocated otherwise. Heap
+    // objects stay in the heap, so moving them only steals the pointer.
+    template<bool OtherAllowAllocations,
+             std::size_t OtherSboSize,
+             std::enable_if_t<(OtherAllowAllocations != AllowAllocations || OtherSboSize != SboSize)
+                                  && Policy::copyable,
+                              bool> = true>
+    polymorphic_value_impl(compatible_t<OtherAllowAllocations, OtherSboSize> const& src)
+        : fields_t{allocator_traits_t::select_on_container_copy_construction(src.get_allocator()),
+                   src.m_vtable}
+    {
+        static_assert(AllowAllocations || (!OtherAllowAllocations && OtherSboSize <= SboSize),
+                      "Allocations are not allowed");
+        convert_from(src);
+    }
+
+    // Objects that don't fit are allocated, so like moves between unequal
+    // allocators, this terminates if memory is exhausted.
+    template<bool OtherAllowAllocations,
+             std::size_t OtherSboSize,
+             std::enable_if_t<OtherAllowAllocations != AllowAllocations || OtherSboSize != SboSize,
+                              bool> = true>
+    polymorphic_value_impl(compatible_t<OtherAllowAllocations, OtherSboSize>&& src) noexcept
+        : fields_t{std::move(src.m_storage.allocator()), src.m_vtable}
+    {
+        static_assert(AllowAllocations || (!OtherAllowAllocations && OtherSboSize <= SboSize),
+                      "Allocations are not allowed");
+        convert_from(std::move(src));
+    }
+
+    polymorphic_value_impl& operator=(copy_source_t const& src)
+    {
+        if (&src == this) {
+            return *this;
+        }
+
+        constexpr bool propagate
+            = allocator_traits_t::propagate_on_container_copy_assignment::value;
+        using propagate_t = std::integral_constant<bool, propagate>;
+
+        if (Policy::copy_on_write && !src.storage_is_local()
+            && (propagate || allocator_equal(src))) {
+            if (m_vtable != src.m_vtable) {
+                detail::record(src.m_vtable, detail::statistics_event::cross_type_assignment);
+            }
+            m_vtable->destroy(&m_storage);
+            propagate_allocator(src.m_storage.allocator(), propagate_t{});
+            m_vtable = src.m_vtable;
+            share_from(src);
+            update_object_pointer();
+        } else if (m_vtable == src.m_vtable && !is_shared()
+                   && (!propagate || allocator_equal(src))) {
+            m_vtable->copy_assign(src.get_object(), get_object());
         } else {
+            if (m_vtable != src.m_vtable) {
+                detail::record(src.m_vtable, detail::statistics_event::cross_type_assignment);
+            }
+            replace_object(src.m_vtable,
+                           src.m_storage.allocator(),
+                           propagate_t{},
+                           !src.m_vtable->info->nothrow_copy,
+                           [&src](storage_t* storage) {
+                               src.m_vtable->copy_construct(src.get_object(), storage);
+                           });
+            record(detail::statistics_event::construction);
+        }
+        record(detail::statistics_event::copy);
+
+        return *this;
+    }
+
+    polymorphic_value_impl& operator=(polymorphic_value_impl&& src) noexcept
+    {
+        if (&src == this) {
+            return *this;
+        }
+
+        constexpr bool propagate
+            = allocator_traits_t::propagate_on_container_move_assignment::value;
+
+        if (m_vtable != src.m_vtable) {
+            detail::record(src.m_vtable, detail::statistics_event::cross_type_assignment);
+        }
+
+        if (allocator_equal(src)) {
+            if (m_vtable != src.m_vtable) {
+                m_vtable->destroy(&m_storage);
+                m_vtable = src.m_vtable;
+                move_from(src);
+            } else if (storage_is_local()) {
+                m_vtable->move_assign(src.get_object(), get_object());
+                record(detail::statistics_event::move);
+            } else {
+                std::swap(m_storage.heap_buffer, src.m_storage.heap_buffer);
+                src.update_object_pointer();
+                record(detail::statistics_event::move);
+            }
+        } else if (propagate) {
             m_vtable->destroy(&m_storage);
-            m_vtable = new_vtable;
-            m_vtable->copy_raw(&src, &m_storage);
+            propagate_allocator(std::move(src.m_storage.allocator()),
+                                std::integral_constant<bool, propagate>{});
+            m_vtable = src.m_vtable;
+            move_from(src);
+        } else {
+            // Memory owned by src can't be released with this allocator, move the
+            // object itself instead of stealing its storage. Shared objects are
+            // copied instead, as other values still use them.
+            if (m_vtable == src.m_vtable && !is_shared() && !src.is_shared()) {
+                m_vtable->move_assign(src.get_object(), get_object());
+            } else {
+                m_vtable->destroy(&m_storage);
+                m_vtable = src.m_vtable;
+                if (src.is_shared()) {
+                    m_vtable->copy_construct(src.get_object(), &m_storage);
+                } else {
+                    m_vtable->move_construct(src.get_object(), &m_storage);
+                }
+                record(detail::statistics_event::construction);
+            }
+            record(detail::statistics_event::move);
         }
 
+        update_object_pointer();
         return *this;
     }
 
+    template<bool OtherAllowAllocations,
+             std::size_t OtherSboSize,
+             std::enable_if_t<(OtherAllowAllocations != AllowAllocations || OtherSboSize != SboSize)
+                                  && Policy::copyable,
+                              bool> = true>
+    polymorphic_value_impl& operator=(compatible_t<OtherAllowAllocations, OtherSboSize> const& src)
+    {
+        return *this = polymorphic_value_impl{src};
+    }
+
+    template<bool OtherAllowAllocations,
+             std::size_t OtherSboSize,
+             std::enable_if_t<OtherAllowAllocations != AllowAllocations || OtherSboSize != SboSize,
+                              bool> = true>
+    polymorphic_value_impl&
+    operator=(compatible_t<OtherAllowAllocations, OtherSboSize>&& src) noexcept
+    {
+        if (!allocator_equal(src)) {
+            return *this = polymorphic_value_impl{std::move(src)};
+        }
+
+        if (m_vtable != src.m_vtable) {
+            detail::record(src.m_vtable, detail::statistics_event::cross_type_assignment);
+        }
+        m_vtable->destroy(&m_storage);
+        m_vtable = src.m_vtable;
+        convert_from(std::move(src));
+        return *this;
+    }
+
+    template<typename Derived, std::enable_if_t<std::is_base_of<Base, Derived>::value, bool> = true>
+    polymorphic_value_impl& operator=(Derived const& src)
+    {
+        return assign(unchecked, detail::check_slicing<Derived>(src));
+    }
+
     template<typename Derived,
              std::enable_if_t<std::is_base_of<Base, Derived>::value
                                   && !std::is_lvalue_reference<Derived>::value,
                               bool> = true>
     polymorphic_value_impl& operator=(Derived&& src)
     {
-        static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
+        return assign(unchecked, detail::check_slicing<Derived>(std::move(src)));
+    }
+
+    // Assignment from an object without the slicing check
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    polymorphic_value_impl& assign(unchecked_t, Derived&& src)
+    {
+        using derived_t = std::decay_t<Derived>;
+
+        static_assert(AllowAllocations || !detail::store_in_heap<derived_t, SboSize, SboAlignment>,
                       "Allocations are not allowed");
-#if POLYMORPHIC_VALUE_RTTI_SUPPORTED
-        if (typeid(std::decay_t<Derived>) != typeid(src)) {
-            throw bad_polymorphic_value{"Value would slice"};
-        }
-#endif
-        auto* new_vtable = detail::get_vtable<Derived, storage_t>::get();
+        detail::assert_no_slicing<derived_t>(src);
+        auto* new_vtable = detail::get_vtable<derived_t, storage_t>::get();
 
-        if (m_vtable == new_vtable) {
-            m_vtable->move_assign_raw(&src, &m_storage);
+        // A shared object is replaced instead of assigned, as other values still use it
+        if (m_vtable == new_vtable && !is_shared()) {
+            *m_storage.template get_as<derived_t>() = std::forward<Derived>(src);
         } else {
-            m_vtable->destroy(&m_storage);
-            m_vtable = new_vtable;
-            m_vtable->move_raw(&src, &m_storage);
+            if (m_vtable != new_vtable) {
+                detail::record(new_vtable, detail::statistics_event::cross_type_assignment);
+            }
+            constexpr bool may_throw
+                = !noexcept(m_storage.template build<derived_t>(std::forward<Derived>(src)));
+            replace_object(new_vtable,
+                           m_storage.allocator(),
+                           std::false_type{},
+                           may_throw,
+                           [&src](storage_t* storage) {
+                               storage->template build<derived_t>(std::forward<Derived>(src));
+                           });
+            record(detail::statistics_event::construction);
         }
+        record(std::is_lvalue_reference<Derived>::value ? detail::statistics_event::copy
+                                                        : detail::statistics_event::move);
 
         return *this;
     }
@@ -387,21 +1601,156 @@ public:
     emplace(Args&&... args) noexcept(
         noexcept(m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...)))
     {
+        using derived_t = std::decay_t<Derived>;
+
         static_assert(AllowAllocations || !detail::store_in_heap<Derived, SboSize, SboAlignment>,
                       "Allocations are not allowed");
-        m_vtable->destroy(&m_storage);
-        m_vtable = detail::get_vtable<std::decay_t<Derived>, storage_t>::get();
-        m_storage.template build<std::decay_t<Derived>>(std::forward<Args>(args)...);
+        replace_object(detail::get_vtable<derived_t, storage_t>::get(),
+                       m_storage.allocator(),
+                       std::false_type{},
+                       !noexcept(m_storage.template build<derived_t>(std::forward<Args>(args)...)),
+                       [&](storage_t* storage) {
+                           storage->template build<derived_t>(std::forward<Args>(args)...);
+                       });
+        record(detail::statistics_event::construction);
     }
 
     ~polymorphic_value_impl() { m_vtable->destroy(&m_storage); }
 
-    Base* operator->() noexcept { return get(); }
+    // Exchange the objects. Heap and trivially relocatable objects are
+    // exchanged by swapping their bytes, other objects are relocated through a
+    // buffer on the stack. Objects whose allocators are unequal and don't
+    // propagate on swap are moved instead.
+    void swap(polymorphic_value_impl& o) noexcept(
+        allocator_traits_t::propagate_on_container_swap::value
+        || allocator_traits_t::is_always_equal::value)
+    {
+        if (&o == this) {
+            return;
+        }
+
+        using propagate_t = typename allocator_traits_t::propagate_on_container_swap;
+        if (!propagate_t::value && !allocator_equal(o)) {
+            polymorphic_value_impl tmp{std::move(o)};
+            o = std::move(*this);
+            *this = std::move(tmp);
+            return;
+        }
+
+        swap_allocators(o, propagate_t{});
+        if (!m_vtable->move && !o.m_vtable->move) {
+            using buffer_t = typename storage_t::buffer_t;
+            buffer_t tmp;
+            std::memcpy(&tmp, static_cast<buffer_t*>(&m_storage), sizeof(buffer_t));
+            m_storage.relocate_from(o.m_storage);
+            std::memcpy(static_cast<buffer_t*>(&o.m_storage), &tmp, sizeof(buffer_t));
+        } else {
+            storage_t tmp{m_storage.allocator()};
+            relocate(m_vtable, m_storage, tmp);
+            relocate(o.m_vtable, o.m_storage, m_storage);
+            relocate(m_vtable, tmp, o.m_storage);
+        }
+        std::swap(m_vtable, o.m_vtable);
+
+        update_object_pointer();
+        o.update_object_pointer();
+        record(detail::statistics_event::move);
+        o.record(detail::statistics_event::move);
+    }
+
+    friend void swap(polymorphic_value_impl& a,
+                     polymorphic_value_impl& b) noexcept(noexcept(a.swap(b)))
+    {
+        a.swap(b);
+    }
+
+    // Non const access to a shared object copies it first
+    Base* operator->() noexcept(!Policy::copy_on_write)
+    {
+        unshare();
+        return get();
+    }
+
     Base const* operator->() const noexcept { return get(); }
-    Base& operator*() noexcept { return *get(); }
+
+    Base& operator*() noexcept(!Policy::copy_on_write)
+    {
+        unshare();
+        return *get();
+    }
+
     Base const& operator*() const noexcept { return *get(); }
 
+    allocator_type get_allocator() const noexcept { return m_storage.allocator(); }
+
+    // Whether the object is stored in the SBO buffer rather than in the heap.
+    // Moved from values have no object and are inline.
+    bool is_inline() const noexcept { return storage_is_local(); }
+
+    // sizeof and alignof the stored object, as recorded in its vtable, 0 and 1
+    // for moved from values
+    std::size_t dynamic_size() const noexcept { return m_vtable->info->size; }
+    std::size_t alignment() const noexcept { return m_vtable->info->alignment; }
+
+    // Bytes used by the value: its own size plus the heap block of its object,
+    // if any. Values sharing a copy on write object each count its block.
+    std::size_t size_in_bytes() const noexcept
+    {
+        return sizeof(*this)
+            + (is_inline() ? 0
+                           : detail::heap_block_size(
+                               dynamic_size(), alignment(), Policy::copy_on_write));
+    }
+
+    // Whether the stored object is exactly a Derived, as told by the vtable
+    // without RTTI nor any call
+    template<typename Derived>
+    bool holds() const noexcept
+    {
+        return find_object<Derived>() != nullptr;
+    }
+
+    // The stored object if it is exactly a Derived, nullptr otherwise
+    template<typename Derived>
+    Derived* target() noexcept(!Policy::copy_on_write)
+    {
+        unshare();
+        return find_object<Derived>();
+    }
+
+    template<typename Derived>
+    Derived const* target() const noexcept
+    {
+        return find_object<Derived>();
+    }
+
+    // Call f with the stored object as the first of Derived that it exactly
+    // is, or as a Base if it is none of them. Comparing the vtable with the
+    // ones of Derived is cheaper than a virtual call, and lets f be inlined
+    // for the most common types. f returns the same type for all of them.
+    template<typename... Derived, typename F>
+    decltype(auto) visit(F&& f)
+    {
+        unshare();
+        return visit_as<Derived...>(*this, f);
+    }
+
+    template<typename... Derived, typename F>
+    decltype(auto) visit(F&& f) const
+    {
+        return visit_as<Derived...>(*this, f);
+    }
+
 private:
+    // Value in the moved from state, for the bulk operations to construct the
+    // object later
+    template<typename Alloc>
+    polymorphic_value_impl(detail::moved_from_t, Alloc&& alloc) noexcept
+        : fields_t{std::forward<Alloc>(alloc), detail::get_moved_from_vtable()}
+    {
+        update_object_pointer();
+    }
+
     bool storage_is_local() const noexcept
     {
         // Trick: local storage vtables are aligned to even alignof(void*)
@@ -410,38 +1759,668 @@ private:
         return reinterpret_cast<std::uintptr_t>(m_vtable) % (alignof(void*) * 2) == 0;
     }
 
-    Base* get() noexcept
+    // Move the object in src into this storage, which must be empty and have
+    // the vtable of src already set.
+    void move_from(polymorphic_value_impl& src) noexcept
+    {
+        if (m_vtable->move) {
+            m_vtable->move(&src.m_storage, &m_storage);
+        } else {
+            m_storage.relocate_from(src.m_storage);
+            src.m_vtable = detail::get_moved_from_vtable();
+        }
+
+        // Heap objects are stolen, not constructed
+        if (storage_is_local()) {
+            record(detail::statistics_event::construction);
+        }
+        record(detail::statistics_event::move);
+    }
+
+    // Replace the object with the one built by construct(storage), which has
+    // the given vtable. alloc is propagated, if Propagate is true, once the
+    // current object is destroyed. If construct may throw, the value is left
+    // unchanged with strong exception safety, or moved from otherwise.
+    template<typename Propagate, typename Construct>
+    void replace_object(detail::polymorphic_value_vtable const* vtable,
+                        Allocator const& alloc,
+                        Propagate propagate,
+                        bool may_throw,
+                        Construct&& construct)
+    {
+        if (Policy::strong_exception_safety && may_throw) {
+            storage_t tmp{Propagate::value ? alloc : m_storage.allocator()};
+            construct(&tmp);
+            m_vtable->destroy(&m_storage);
+            propagate_allocator(alloc, propagate);
+            m_vtable = vtable;
+            relocate(vtable, tmp, m_storage);
+        } else {
+            m_vtable->destroy(&m_storage);
+            m_vtable = detail::get_moved_from_vtable();
+            propagate_allocator(alloc, propagate);
+            construct(&m_storage);
+            m_vtable = vtable;
+        }
+        update_object_pointer();
+    }
+
+    // Move the object of src, which has the given vtable, into the empty dst,
+    // leaving src empty. The allocators must be equal.
+    static void relocate(detail::polymorphic_value_vtable const* vtable,
+                         storage_t& src,
+                         storage_t& dst) noexcept
+    {
+        if (vtable->move) {
+            vtable->move(&src, &dst);
+            vtable->destroy(&src);
+        } else {
+            dst.relocate_from(src);
+        }
+    }
+
+    void swap_allocators(polymorphic_value_impl& o, std::true_type) noexcept
+    {
+        using std::swap;
+        swap(m_storage.allocator(), o.m_storage.allocator());
+    }
+
+    void swap_allocators(polymorphic_value_impl&, std::false_type) noexcept {}
+
+    // Record an operation on the current object, no-op unless
+    // POLYMORPHIC_VALUE_STATISTICS is defined
+    void record(detail::statistics_event event) const noexcept { detail::record(m_vtable, event); }
+
+    // Whether the object is shared with other copy on write values
+    bool is_shared() const noexcept
+    {
+        return Policy::copy_on_write && !storage_is_local()
+            && detail::get_shared_count(m_storage.heap_buffer).load(std::memory_order_acquire) > 1;
+    }
+
+    // Whether the object of src can be shared instead of copied, as it will be
+    // released with an allocator equal to the one that allocated it
+    template<typename Other>
+    bool can_share(Other const& src) const noexcept
+    {
+        return Policy::copy_on_write && !src.storage_is_local() && allocator_equal(src);
+    }
+
+    // Take a reference to the heap object of src. This storage must be empty
+    // and have the vtable of src already set.
+    template<typename Other>
+    void share_from(Other const& src) noexcept
+    {
+        m_storage.heap_buffer = src.m_storage.heap_buffer;
+        detail::get_shared_count(m_storage.heap_buffer).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Replace a shared object with a copy owned only by this value
+    void unshare()
+    {
+        if (is_shared()) {
+            storage_t shared{m_storage.allocator()};
+            shared.heap_buffer = m_storage.heap_buffer;
+            m_vtable->copy_construct(shared.heap_buffer, &m_storage);
+            m_vtable->destroy(&shared);
+            update_object_pointer();
+            record(detail::statistics_event::construction);
+            record(detail::statistics_event::copy);
+        }
+    }
+
+    template<typename Other>
+    bool allocator_equal(Other const& src) const noexcept
+    {
+        return allocator_traits_t::is_always_equal::value
+            || m_storage.allocator() == src.m_storage.allocator();
+    }
+
+    template<typename Alloc>
+    void propagate_allocator(Alloc&& alloc, std::true_type) noexcept
+    {
+        m_storage.allocator() = std::forward<Alloc>(alloc);
+    }
+
+    template<typename Alloc>
+    void propagate_allocator(Alloc&&, std::false_type) noexcept
+    {
+    }
+
+    // Address of the stored object, as the derived type
+    void* get_object() noexcept
     {
         if (storage_is_local()) {
-            return reinterpret_cast<Base*>(&m_storage.local_buffer);
+            return m_storage.local_buffer.data();
         } else {
-            return static_cast<Base*>(m_storage.heap_buffer);
+            return m_storage.heap_buffer;
         }
     }
 
-    Base const* get() const noexcept
+    void const* get_object() const noexcept
     {
         if (storage_is_local()) {
-            return reinterpret_cast<Base const*>(&m_storage.local_buffer);
+            return m_storage.local_buffer.data();
         } else {
-            return static_cast<Base const*>(m_storage.heap_buffer);
+            return m_storage.heap_buffer;
         }
     }
 
-    storage_t m_storage;
-    detail::polymorphic_value_vtable const* m_vtable;
+    Base* get() noexcept { return get(cache_object_pointer_t{}); }
+    Base const* get() const noexcept { return get(cache_object_pointer_t{}); }
+
+    Base* get(std::true_type) noexcept { return this->m_object; }
+    Base const* get(std::true_type) const noexcept { return this->m_object; }
+    Base* get(std::false_type) noexcept { return static_cast<Base*>(get_object()); }
+
+    Base const* get(std::false_type) const noexcept
+    {
+        return static_cast<Base const*>(get_object());
+    }
+
+    // The object as a Derived if it is exactly one. It is stored where
+    // get_vtable puts it, or in the heap when converted from a value with a
+    // smaller buffer, the two vtables it may have.
+    template<typename Derived>
+    Derived* find_object() const noexcept
+    {
+        static_assert(std::is_base_of<Base, Derived>::value, "Type is not derived from Base");
+
+        auto& storage = const_cast<storage_t&>(m_storage);
+        if (m_vtable == detail::get_vtable<Derived, storage_t>::get()) {
+            return storage.template get_as<Derived>();
+        }
+        if (!detail::store_in_heap<Derived, storage_t::sbo_size, storage_t::sbo_alignment>
+            && m_vtable == detail::get_vtable<Derived, storage_t, true>::get()) {
+            return static_cast<Derived*>(storage.heap_buffer);
+        }
+        return nullptr;
+    }
+
+    template<typename Self, typename F>
+    static auto visit_as(Self& self, F& f) -> decltype(f(*self.get()))
+    {
+        return f(*self.get());
+    }
+
+    template<typename Derived, typename... Rest, typename Self, typename F>
+    static auto visit_as(Self& self, F& f) -> decltype(f(*self.get()))
+    {
+        using object_t = std::conditional_t<std::is_const<Self>::value, Derived const, Derived>;
+        if (object_t* const object = self.template find_object<Derived>()) {
+            return f(*object);
+        }
+        return visit_as<Rest...>(self, f);
+    }
+
+    // Must be called whenever the stored object changes its address
+    void update_object_pointer() noexcept
+    {
+        this->set_object_pointer(static_cast<Base*>(get_object()));
+    }
+
+    // Copy the object of a value with another SBO size into this storage,
+    // which must be empty and have the vtable of src already set
+    template<bool OtherAllowAllocations, std::size_t OtherSboSize>
+    void convert_from(compatible_t<OtherAllowAllocations, OtherSboSize> const& src)
+    {
+        if (can_share(src)) {
+            share_from(src);
+        } else {
+            if (src.storage_is_local() && m_vtable->info->size > SboSize) {
+                m_vtable = m_vtable->info->heap_vtable;
+            }
+            m_vtable->copy_construct(src.get_object(), &m_storage);
+            record(detail::statistics_event::construction);
+        }
+        update_object_pointer();
+        record(detail::statistics_event::copy);
+    }
+
+    // Move the object of a value with another SBO size into this storage, like
+    // move_from. The allocators must be equal.
+    template<bool OtherAllowAllocations, std::size_t OtherSboSize>
+    void convert_from(compatible_t<OtherAllowAllocations, OtherSboSize>&& src) noexcept
+    {
+        if (!src.storage_is_local()) {
+            m_storage.heap_buffer = src.m_storage.heap_buffer;
+            src.m_vtable = detail::get_moved_from_vtable();
+        } else if (m_vtable->info->size <= SboSize) {
+            if (m_vtable->move) {
+                m_vtable->move(&src.m_storage, &m_storage);
+            } else {
+                // The buffers have different sizes, only the object is copied
+                std::memcpy(m_storage.local_buffer.data(),
+                            src.m_storage.local_buffer.data(),
+                            m_vtable->info->size);
+                src.m_vtable = detail::get_moved_from_vtable();
+            }
+            record(detail::statistics_event::construction);
+        } else {
+            m_vtable = m_vtable->info->heap_vtable;
+            m_vtable->move_construct(src.get_object(), &m_storage);
+            record(detail::statistics_event::construction);
+        }
+        update_object_pointer();
+        record(detail::statistics_event::move);
+    }
+};
+
+// Operations on arrays of values. Consecutive values storing the same type in
+// the same way have the same vtable, so each run of them costs a single
+// indirect call to a loop specialized for the type.
+template<typename Base,
+         bool AllowAllocations,
+         std::size_t SboSize,
+         std::size_t SboAlignment,
+         typename Allocator,
+         typename Policy>
+struct bulk_operations<
+    polymorphic_value_impl<Base, AllowAllocations, SboSize, SboAlignment, Allocator, Policy>> {
+    using value_t
+        = polymorphic_value_impl<Base, AllowAllocations, SboSize, SboAlignment, Allocator, Policy>;
+    using allocator_traits_t = std::allocator_traits<Allocator>;
+
+    // Values whose objects can be relocated by copying their bytes can be
+    // relocated as a whole if their allocator can too
+    constexpr static bool relocatable_allocator = std::is_trivially_copyable<Allocator>::value;
+
+    // End of the run of values with the same vtable starting at begin
+    static std::size_t run_end(value_t const* values, std::size_t begin, std::size_t n) noexcept
+    {
+        auto* const vtable = values[begin].m_vtable;
+        auto end = begin + 1;
+        while (end < n && values[end].m_vtable == vtable) {
+            ++end;
+        }
+        return end;
+    }
+
+    static void destroy_n(value_t* values, std::size_t n) noexcept
+    {
+        for (std::size_t i = 0; i < n;) {
+            auto const end = run_end(values, i, n);
+            values[i].m_vtable->info->destroy_n(&values[i].m_storage, sizeof(value_t), end - i);
+
+            // What is left is the allocator
+            if (!std::is_trivially_destructible<Allocator>::value) {
+                for (auto j = i; j < end; ++j) {
+                    values[j].m_vtable = get_moved_from_vtable();
+                    values[j].~value_t();
+                }
+            }
+            i = end;
+        }
+    }
+
+    static value_t* uninitialized_copy_n(value_t const* src, std::size_t n, value_t* dst)
+    {
+        return uninitialized_copy_n(src, n, dst, [](value_t const& v) {
+            return allocator_traits_t::select_on_container_copy_construction(v.get_allocator());
+        });
+    }
+
+    static value_t* uninitialized_copy_n(std::allocator_arg_t,
+                                         Allocator const& alloc,
+                                         value_t const* src,
+                                         std::size_t n,
+                                         value_t* dst)
+    {
+        return uninitialized_copy_n(
+            src, n, dst, [&alloc](value_t const&) -> Allocator const& { return alloc; });
+    }
+
+    // Copies whose allocators are allocator_for(src[i])
+    template<typename AllocatorFor>
+    static value_t* uninitialized_copy_n(value_t const* src,
+                                         std::size_t n,
+                                         value_t* dst,
+                                         AllocatorFor&& allocator_for)
+    {
+        static_assert(Policy::copyable, "Move only values can't be copied");
+
+        // Whether objects are shared depends on the allocator of each value
+        if (Policy::copy_on_write) {
+            std::size_t i = 0;
+            try {
+                for (; i < n; ++i) {
+                    new (dst + i) value_t{std::allocator_arg, allocator_for(src[i]), src[i]};
+                }
+            } catch (...) {
+                destroy_n(dst, i);
+                throw;
+            }
+            return dst + n;
+        }
+
+        // All the values are constructed first, so that they can be destroyed
+        // together if a copy throws
+        for (std::size_t i = 0; i < n; ++i) {
+            new (dst + i) value_t{moved_from_t{}, allocator_for(src[i])};
+        }
+
+        try {
+            for (std::size_t i = 0; i < n;) {
+                auto const end = run_end(src, i, n);
+                auto* const vtable = src[i].m_vtable;
+                vtable->info->copy_n(
+                    &src[i].m_storage, &dst[i].m_storage, sizeof(value_t), end - i);
+                for (auto j = i; j < end; ++j) {
+                    dst[j].m_vtable = vtable;
+                    dst[j].update_object_pointer();
+                    dst[j].record(statistics_event::construction);
+                    dst[j].record(statistics_event::copy);
+                }
+                i = end;
+            }
+        } catch (...) {
+            destroy_n(dst, n);
+            throw;
+        }
+
+        return dst + n;
+    }
+
+    static value_t* uninitialized_relocate_n(value_t* src, std::size_t n, value_t* dst) noexcept
+    {
+        for (std::size_t i = 0; i < n;) {
+            auto const end = run_end(src, i, n);
+            auto* const vtable = src[i].m_vtable;
+            if (!vtable->move && relocatable_allocator) {
+                std::memcpy(static_cast<void*>(dst + i),
+                            static_cast<void const*>(src + i),
+                            (end - i) * sizeof(value_t));
+            } else {
+                for (auto j = i; j < end; ++j) {
+                    new (dst + j) value_t{moved_from_t{}, std::move(src[j].m_storage.allocator())};
+                }
+                vtable->info->relocate_n(
+                    &src[i].m_storage, &dst[i].m_storage, sizeof(value_t), end - i);
+                for (auto j = i; j < end; ++j) {
+                    dst[j].m_vtable = vtable;
+                    src[j].m_vtable = get_moved_from_vtable();
+                    src[j].~value_t();
+                }
+            }
+
+            for (auto j = i; j < end; ++j) {
+                dst[j].update_object_pointer();
+                if (dst[j].storage_is_local()) {
+                    dst[j].record(statistics_event::construction);
+                }
+                dst[j].record(statistics_event::move);
+            }
+            i = end;
+        }
+
+        return dst + n;
+    }
+};
+
+// Keys identifying the types of the objects stored in values sharing a
+// storage_layout, no matter if they are stored locally or in the heap: the
+// heap vtable of the type, which is instantiated for any type. Moved from
+// values have a null key.
+template<typename Base,
+         bool AllowAllocations,
+         std::size_t SboSize,
+         std::size_t SboAlignment,
+         typename Allocator,
+         typename Policy>
+struct type_keys<
+    polymorphic_value_impl<Base, AllowAllocations, SboSize, SboAlignment, Allocator, Policy>> {
+    using value_t
+        = polymorphic_value_impl<Base, AllowAllocations, SboSize, SboAlignment, Allocator, Policy>;
+    using layout_t = typename value_t::storage_t::layout;
+
+    template<typename Derived>
+    static void const* of() noexcept
+    {
+        return vtable_for<Derived, layout_t, true>::get();
+    }
+
+    static void const* of(value_t const& value) noexcept
+    {
+        return value.m_vtable->info->heap_vtable;
+    }
 };
 
+// The buffer is padded to a multiple of its alignment anyway, so the padding
+// is used to store larger objects locally
+constexpr std::size_t sbo_capacity(std::size_t size, std::size_t alignment) noexcept
+{
+    return (std::max(size, sizeof(void*)) + alignment - 1) / alignment * alignment;
+}
+
 } // detail
 
 template<typename Base,
          bool AllowAllocations = true,
          std::size_t SboSize = sizeof(void*) * 3,
-         std::size_t SboAlignment = alignof(void*)>
-using polymorphic_value = detail::polymorphic_value_impl<Base,
-                                                         AllowAllocations,
-                                                         std::max(SboSize, sizeof(void*)),
-                                                         std::max(SboAlignment, alignof(void*))>;
+         std::size_t SboAlignment = alignof(void*),
+         typename Allocator = std::allocator<char>,
+         typename Policy = default_policy>
+using polymorphic_value
+    = detail::polymorphic_value_impl<Base,
+                                     AllowAllocations,
+                                     detail::sbo_capacity(SboSize,
+                                                          std::max(SboAlignment, alignof(void*))),
+                                     std::max(SboAlignment, alignof(void*)),
+                                     Allocator,
+                                     Policy>;
+
+// Where the bytes of a Value go. Values are padded when the alignment of the
+// SBO buffer is larger than the one of the pointers next to it.
+template<typename Value>
+struct layout_report {
+    using allocator_type = typename Value::allocator_type;
+    using policy_type = typename Value::policy_type;
+
+    constexpr static std::size_t size = sizeof(Value);
+    // Objects up to this size are stored locally
+    constexpr static std::size_t sbo_size = Value::sbo_size;
+    constexpr static std::size_t vtable_size = sizeof(void*);
+    constexpr static std::size_t allocator_size
+        = std::is_empty<detail::allocator_holder<allocator_type>>::value
+        ? 0
+        : sizeof(allocator_type);
+    constexpr static std::size_t object_pointer_size
+        = policy_type::cache_object_pointer ? sizeof(void*) : 0;
+
+    constexpr static std::size_t padding
+        = size - sbo_size - vtable_size - allocator_size - object_pointer_size;
+};
+
+namespace detail {
+
+template<typename Base,
+         std::size_t Size,
+         std::size_t SboAlignment,
+         typename Allocator,
+         typename Policy>
+struct sized_value {
+    // Everything but the buffer, which is as small as it can be
+    using smallest_t = polymorphic_value<Base, true, 0, SboAlignment, Allocator, Policy>;
+    constexpr static std::size_t overhead = sizeof(smallest_t) - smallest_t::sbo_size;
+    static_assert(Size >= sizeof(smallest_t), "Size is too small for a value");
+
+    using type = polymorphic_value<Base, true, Size - overhead, SboAlignment, Allocator, Policy>;
+    static_assert(sizeof(type) == Size, "Size is not a multiple of the alignment of the value");
+};
+
+} // namespace detail
+
+// polymorphic_value whose size is exactly Size, e.g. a cache line, with the
+// largest SBO buffer that fits
+template<typename Base,
+         std::size_t Size,
+         std::size_t SboAlignment = alignof(void*),
+         typename Allocator = std::allocator<char>,
+         typename Policy = default_policy>
+using sized_polymorphic_value =
+    typename detail::sized_value<Base, Size, SboAlignment, Allocator, Policy>::type;
+
+// Why a Value stores a Derived in the heap instead of its SBO buffer
+template<typename Value, typename Derived>
+struct heap_storage_reasons {
+    constexpr static bool too_large = sizeof(Derived) > Value::sbo_size;
+    constexpr static bool over_aligned = alignof(Derived) > Value::sbo_alignment;
+    // Objects are moved when values are, which must not throw
+    constexpr static bool throwing_move = !is_nothrow_movable<Derived>::value;
+
+    constexpr static bool stored_in_heap = too_large || over_aligned || throwing_move;
+};
+
+namespace detail {
+
+template<typename Value, typename Derived>
+struct local_storage_check {
+    using reasons = heap_storage_reasons<Value, Derived>;
+    static_assert(!reasons::too_large, "Type is larger than the SBO buffer");
+    static_assert(!reasons::over_aligned, "Type is more aligned than the SBO buffer");
+    static_assert(!reasons::throwing_move, "Type move constructor may throw");
+
+    constexpr static bool value = true;
+};
+
+// Smallest SBO buffer storing all of Derived
+template<typename Base, typename... Derived>
+struct sbo_requirements {
+    static_assert(sizeof...(Derived) > 0, "No type to store");
+    static_assert(std::min({std::is_base_of<Base, Derived>::value...}),
+                  "Type is not derived from Base");
+    static_assert(std::min({is_nothrow_movable<Derived>::value...}),
+                  "Types whose move constructor may throw are always stored in the heap");
+
+    constexpr static std::size_t size = std::max({sizeof(Derived)...});
+    constexpr static std::size_t alignment = std::max({alignof(Derived)...});
+};
+
+} // namespace detail
+
+// Fails to compile, saying why, if Value stores any of Derived in the heap.
+// Use as static_assert(pmv::assert_stored_locally<Value, Derived...>, "").
+template<typename Value, typename... Derived>
+constexpr bool assert_stored_locally
+    = std::min({detail::local_storage_check<Value, Derived>::value...});
+
+// polymorphic_value with the smallest SBO buffer storing all of Derived
+// locally. Other types can still be stored, in the heap if they don't fit.
+template<typename Base, typename... Derived>
+using polymorphic_value_for
+    = polymorphic_value<Base,
+                        true,
+                        detail::sbo_requirements<Base, Derived...>::size,
+                        detail::sbo_requirements<Base, Derived...>::alignment>;
+
+// Memory used by a range of values, see measure_memory
+struct memory_usage {
+    std::size_t values = 0;
+    // Values whose object is in the heap
+    std::size_t heap_objects = 0;
+    // sizeof the values themselves
+    std::size_t inline_bytes = 0;
+    // Heap blocks of their objects
+    std::size_t heap_bytes = 0;
+
+    std::size_t total_bytes() const noexcept { return inline_bytes + heap_bytes; }
+
+    memory_usage& operator+=(memory_usage const& o) noexcept
+    {
+        values += o.values;
+        heap_objects += o.heap_objects;
+        inline_bytes += o.inline_bytes;
+        heap_bytes += o.heap_bytes;
+        return *this;
+    }
+};
+
+// Add up the size_in_bytes() of the values in [first, last), e.g. to bound a
+// cache by bytes rather than by number of values
+template<typename InputIt>
+memory_usage measure_memory(InputIt first, InputIt last)
+{
+    memory_usage usage;
+    for (; first != last; ++first) {
+        auto const& value = *first;
+        auto const bytes = value.size_in_bytes();
+        ++usage.values;
+        usage.inline_bytes += sizeof(value);
+        if (!value.is_inline()) {
+            ++usage.heap_objects;
+            usage.heap_bytes += bytes - sizeof(value);
+        }
+    }
+    return usage;
+}
+
+// Same, for all the values of a container
+template<typename Container>
+memory_usage measure_memory(Container const& values)
+{
+    using std::begin;
+    using std::end;
+    return measure_memory(begin(values), end(values));
+}
+
+// Destroy n values. Runs of values storing the same type are destroyed by a
+// single loop specialized for it, instead of an indirect call per value.
+template<typename Value>
+void destroy_n(Value* first, std::size_t n) noexcept
+{
+    detail::bulk_operations<Value>::destroy_n(first, n);
+}
+
+// Copy n values into uninitialized memory, like std::uninitialized_copy_n
+// but with a single indirect call per run of values storing the same type.
+// If a copy throws, the values already constructed are destroyed. Returns the
+// end of the copies.
+template<typename Value>
+Value* uninitialized_copy_n(Value const* first, std::size_t n, Value* d_first)
+{
+    return detail::bulk_operations<Value>::uninitialized_copy_n(first, n, d_first);
+}
+
+// Same, the copies using alloc, e.g. an arena, instead of the allocators
+// selected from the ones of the values
+template<typename Value>
+Value* uninitialized_copy_n(std::allocator_arg_t,
+                            typename Value::allocator_type const& alloc,
+                            Value const* first,
+                            std::size_t n,
+                            Value* d_first)
+{
+    return detail::bulk_operations<Value>::uninitialized_copy_n(
+        std::allocator_arg, alloc, first, n, d_first);
+}
+
+// Move n values into uninitialized memory and destroy them, leaving first
+// uninitialized. Runs of trivially relocatable values are copied with a single
+// memcpy. Returns the end of the moved values.
+template<typename Value>
+Value* uninitialized_relocate_n(Value* first, std::size_t n, Value* d_first) noexcept
+{
+    return detail::bulk_operations<Value>::uninitialized_relocate_n(first, n, d_first);
+}
+
+#if POLYMORPHIC_VALUE_PMR_SUPPORTED
+namespace pmr {
+
+// polymorphic_value allocating heap stored objects from a std::pmr::memory_resource
+template<typename Base,
+         bool AllowAllocations = true,
+         std::size_t SboSize = sizeof(void*) * 3,
+         std::size_t SboAlignment = alignof(void*),
+         typename Policy = default_policy>
+using polymorphic_value = pmv::polymorphic_value<Base,
+                                                 AllowAllocations,
+                                                 SboSize,
+                                                 SboAlignment,
+                                                 std::pmr::polymorphic_allocator<char>,
+                                                 Policy>;
+
+} // namespace pmr
+#endif
 
 } // pmv
 
@@ -0,0 +1,432 @@
+#ifndef POLYMORPHIC_VECTOR_INCLUDE_H
+#define POLYMORPHIC_VECTOR_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pmv {
+
+// Sequence of objects derived from Base, packed in a single buffer. Each object
+// takes only its own size (plus alignment padding), as opposed to a vector of
+// polymorphic_value where every element takes the whole SBO buffer.
+//
+// Objects are also indexed by type, so for_each_by_type() visits all the objects
+// of the same type together.
+template<typename Base>
+class polymorphic_vector {
+    static_assert(std::is_polymorphic<Base>::value, "Class is not polymorphic");
+
+    // Objects always live in the vector buffer, so only local vtables are used.
+    using storage_t = detail::sbo_storage<sizeof(void*), alignof(void*), std::allocator<char>>;
+    using vtable_t = detail::polymorphic_value_vtable;
+    static_assert(storage_t::layout::buffer_offset == 0,
+                  "Objects are passed to the vtable as their own storage");
+
+    struct entry {
+        vtable_t const* vtable;
+        std::size_t offset;
+    };
+
+    struct type_group {
+        vtable_t const* vtable;
+        std::vector<std::size_t> offsets;
+    };
+
+    template<typename B, typename Data>
+    class basic_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::remove_const_t<B>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = B*;
+        using reference = B&;
+
+        basic_iterator() noexcept = default;
+
+        reference operator*() const noexcept { return *operator->(); }
+        pointer operator->() const noexcept
+        {
+            return reinterpret_cast<pointer>(m_data + m_entry->offset);
+        }
+
+        basic_iterator& operator++() noexcept
+        {
+            ++m_entry;
+            return *this;
+        }
+
+        basic_iterator operator++(int) noexcept
+        {
+            auto ret = *this;
+            ++m_entry;
+            return ret;
+        }
+
+        friend bool operator==(basic_iterator const& a, basic_iterator const& b) noexcept
+        {
+            return a.m_entry == b.m_entry;
+        }
+
+        friend bool operator!=(basic_iterator const& a, basic_iterator const& b) noexcept
+        {
+            return a.m_entry != b.m_entry;
+        }
+
+    private:
+        friend class polymorphic_vector;
+
+        basic_iterator(Data* data, entry const* e) noexcept : m_data{data}, m_entry{e} {}
+
+        Data* m_data = nullptr;
+        entry const* m_entry = nullptr;
+    };
+
+public:
+    using value_type = Base;
+    using size_type = std::size_t;
+    using reference = Base&;
+    using const_reference = Base const&;
+    using iterator = basic_iterator<Base, char>;
+    using const_iterator = basic_iterator<Base const, char const>;
+
+    polymorphic_vector() noexcept = default;
+
+    polymorphic_vector(polymorphic_vector const& src)
+        : m_entries{}
+        , m_capacity{src.m_capacity}
+        , m_alignment{src.m_alignment}
+        , m_all_relocatable{src.m_all_relocatable}
+    {
+        m_entries.reserve(src.m_entries.size());
+        allocate(m_buffer, m_data, m_capacity, m_alignment);
+
+        try {
+            for (auto const& e : src.m_entries) {
+                e.vtable->copy_construct(src.m_data + e.offset, m_data + e.offset);
+                m_entries.push_back(e);
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+
+        m_groups = src.m_groups;
+        m_size_bytes = src.m_size_bytes;
+    }
+
+    polymorphic_vector(polymorphic_vector&& src) noexcept { swap(src); }
+
+    polymorphic_vector& operator=(polymorphic_vector const& src)
+    {
+        if (&src != this) {
+            polymorphic_vector tmp{src};
+            swap(tmp);
+        }
+        return *this;
+    }
+
+    polymorphic_vector& operator=(polymorphic_vector&& src) noexcept
+    {
+        if (&src != this) {
+            clear();
+            swap(src);
+        }
+        return *this;
+    }
+
+    ~polymorphic_vector() { clear(); }
+
+    void swap(polymorphic_vector& o) noexcept
+    {
+        using std::swap;
+        swap(m_buffer, o.m_buffer);
+        swap(m_data, o.m_data);
+        swap(m_entries, o.m_entries);
+        swap(m_groups, o.m_groups);
+        swap(m_size_bytes, o.m_size_bytes);
+        swap(m_capacity, o.m_capacity);
+        swap(m_alignment, o.m_alignment);
+        swap(m_all_relocatable, o.m_all_relocatable);
+        swap(m_last_group, o.m_last_group);
+    }
+
+    friend void swap(polymorphic_vector& a, polymorphic_vector& b) noexcept { a.swap(b); }
+
+    template<typename Derived, typename... Args>
+    std::enable_if_t<std::is_base_of<Base, Derived>::value, Derived&> emplace_back(Args&&... args)
+    {
+        static_assert(is_nothrow_movable<Derived>::value,
+                      "Objects must be nothrow move constructible");
+
+        auto const offset = align_up(m_size_bytes, alignof(Derived));
+        auto const end = offset + sizeof(Derived);
+        if (end > m_capacity || alignof(Derived) > m_alignment) {
+            reallocate(std::max(end, m_capacity * 2), std::max(alignof(Derived), m_alignment));
+        }
+
+        auto* const vtable = detail::get_vtable<Derived, storage_t, false>::get();
+        auto& group = find_group(vtable);
+        reserve_one(m_entries);
+        reserve_one(group.offsets);
+
+        auto* const object = new (m_data + offset) Derived{std::forward<Args>(args)...};
+
+        m_entries.push_back({vtable, offset});
+        group.offsets.push_back(offset);
+        m_size_bytes = end;
+        m_all_relocatable = m_all_relocatable && !vtable->move;
+
+        return *object;
+    }
+
+    template<typename Derived,
+             std::enable_if_t<std::is_base_of<Base, std::decay_t<Derived>>::value, bool> = true>
+    void push_back(Derived&& d)
+    {
+        emplace_back<std::decay_t<Derived>>(
+            detail::check_slicing<Derived>(std::forward<Derived>(d)));
+    }
+
+    void pop_back() noexcept
+    {
+        auto const e = m_entries.back();
+        e.vtable->destroy(m_data + e.offset);
+        m_entries.pop_back();
+        find_group(e.vtable).offsets.pop_back();
+        m_size_bytes = e.offset;
+    }
+
+    void clear() noexcept
+    {
+        for (auto const& e : m_entries) {
+            e.vtable->destroy(m_data + e.offset);
+        }
+        m_entries.clear();
+        m_groups.clear();
+        m_size_bytes = 0;
+        m_all_relocatable = true;
+        m_last_group = 0;
+    }
+
+    // Make room for a total of bytes of object storage
+    void reserve_bytes(std::size_t bytes)
+    {
+        if (bytes > m_capacity) {
+            reallocate(bytes, m_alignment);
+        }
+    }
+
+    std::size_t size() const noexcept { return m_entries.size(); }
+    // Number of objects that can be stored before the bookkeeping grows
+    std::size_t capacity() const noexcept { return m_entries.capacity(); }
+    bool empty() const noexcept { return m_entries.empty(); }
+
+    // Bytes used by the objects, including the alignment padding between them
+    std::size_t size_bytes() const noexcept { return m_size_bytes; }
+    std::size_t capacity_bytes() const noexcept { return m_capacity; }
+
+    // Number of different types stored
+    std::size_t type_count() const noexcept
+    {
+        return static_cast<std::size_t>(
+            std::count_if(m_groups.begin(), m_groups.end(), [](type_group const& g) {
+                return !g.offsets.empty();
+            }));
+    }
+
+    Base& operator[](std::size_t i) noexcept { return *object_at(m_entries[i].offset); }
+    Base const& operator[](std::size_t i) const noexcept { return *object_at(m_entries[i].offset); }
+
+    Base& front() noexcept { return (*this)[0]; }
+    Base const& front() const noexcept { return (*this)[0]; }
+    Base& back() noexcept { return (*this)[size() - 1]; }
+    Base const& back() const noexcept { return (*this)[size() - 1]; }
+
+    iterator begin() noexcept { return {m_data, m_entries.data()}; }
+    iterator end() noexcept { return {m_data, m_entries.data() + m_entries.size()}; }
+    const_iterator begin() const noexcept { return {m_data, m_entries.data()}; }
+    const_iterator end() const noexcept { return {m_data, m_entries.data() + m_entries.size()}; }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    // Call f with every object, in insertion order
+    template<typename F>
+    void for_each(F&& f)
+    {
+        for (auto const& e : m_entries) {
+            f(*object_at(e.offset));
+        }
+    }
+
+    template<typename F>
+    void for_each(F&& f) const
+    {
+        for (auto const& e : m_entries) {
+            f(*object_at(e.offset));
+        }
+    }
+
+    // Call f with every object, visiting all the objects of the same type
+    // together. Objects of the same type are visited in insertion order.
+    template<typename F>
+    void for_each_by_type(F&& f)
+    {
+        for (auto const& group : m_groups) {
+            for (auto const offset : group.offsets) {
+                f(*object_at(offset));
+            }
+        }
+    }
+
+    template<typename F>
+    void for_each_by_type(F&& f) const
+    {
+        for (auto const& group : m_groups) {
+            for (auto const offset : group.offsets) {
+                f(*object_at(offset));
+            }
+        }
+    }
+
+    // Call f with every object of type Derived, as a Derived. This doesn't need
+    // any virtual call to reach the objects.
+    template<typename Derived, typename F>
+    void for_each_of_type(F&& f)
+    {
+        auto* const vtable = detail::get_vtable<Derived, storage_t, false>::get();
+        for (auto const& group : m_groups) {
+            if (group.vtable == vtable) {
+                for (auto const offset : group.offsets) {
+                    f(*reinterpret_cast<Derived*>(m_data + offset));
+                }
+                return;
+            }
+        }
+    }
+
+    template<typename Derived, typename F>
+    void for_each_of_type(F&& f) const
+    {
+        auto* const vtable = detail::get_vtable<Derived, storage_t, false>::get();
+        for (auto const& group : m_groups) {
+            if (group.vtable == vtable) {
+                for (auto const offset : group.offsets) {
+                    f(*reinterpret_cast<Derived const*>(m_data + offset));
+                }
+                return;
+            }
+        }
+    }
+
+private:
+    static std::size_t align_up(std::size_t n, std::size_t alignment) noexcept
+    {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    // Make room for one more element, growing geometrically, so that the
+    // push_back after the object is constructed can't throw
+    template<typename T>
+    static void reserve_one(std::vector<T>& v)
+    {
+        if (v.size() == v.capacity()) {
+            v.reserve(std::max<std::size_t>(1, 2 * v.capacity()));
+        }
+    }
+
+    static void allocate(std::unique_ptr<char[]>& buffer,
+                         char*& data,
+                         std::size_t capacity,
+                         std::size_t alignment)
+    {
+        if (capacity == 0) {
+            return;
+        }
+        buffer.reset(new char[capacity + alignment - 1]);
+        auto const address = reinterpret_cast<std::uintptr_t>(buffer.get());
+        data = buffer.get() + (align_up(address, alignment) - address);
+    }
+
+    Base* object_at(std::size_t offset) noexcept
+    {
+        return reinterpret_cast<Base*>(m_data + offset);
+    }
+
+    Base const* object_at(std::size_t offset) const noexcept
+    {
+        return reinterpret_cast<Base const*>(m_data + offset);
+    }
+
+    type_group& find_group(vtable_t const* vtable)
+    {
+        if (m_last_group < m_groups.size() && m_groups[m_last_group].vtable == vtable) {
+            return m_groups[m_last_group];
+        }
+
+        for (std::size_t i = 0; i < m_groups.size(); ++i) {
+            if (m_groups[i].vtable == vtable) {
+                m_last_group = i;
+                return m_groups[i];
+            }
+        }
+
+        m_groups.push_back({vtable, {}});
+        m_last_group = m_groups.size() - 1;
+        return m_groups.back();
+    }
+
+    // Move every object to a new buffer. Offsets are kept, which is fine as the
+    // new buffer is at least as aligned as the old one.
+    void reallocate(std::size_t capacity, std::size_t alignment)
+    {
+        std::unique_ptr<char[]> buffer;
+        char* data = nullptr;
+        allocate(buffer, data, capacity, alignment);
+
+        if (m_all_relocatable) {
+            if (m_size_bytes) {
+                std::memcpy(data, m_data, m_size_bytes);
+            }
+        } else {
+            for (std::size_t i = 0; i < m_entries.size(); ++i) {
+                auto const& e = m_entries[i];
+                if (e.vtable->move) {
+                    e.vtable->move(m_data + e.offset, data + e.offset);
+                    e.vtable->destroy(m_data + e.offset);
+                } else {
+                    auto const next
+                        = i + 1 < m_entries.size() ? m_entries[i + 1].offset : m_size_bytes;
+                    std::memcpy(data + e.offset, m_data + e.offset, next - e.offset);
+                }
+            }
+        }
+
+        m_buffer = std::move(buffer);
+        m_data = data;
+        m_capacity = capacity;
+        m_alignment = alignment;
+    }
+
+    std::unique_ptr<char[]> m_buffer;
+    char* m_data = nullptr;
+    std::vector<entry> m_entries;
+    std::vector<type_group> m_groups;
+    std::size_t m_size_bytes = 0;
+    std::size_t m_capacity = 0;
+    std::size_t m_alignment = alignof(void*);
+    bool m_all_relocatable = true;
+    std::size_t m_last_group = 0;
+};
+
+} // pmv
+
+#endif // POLYMORPHIC_VECTOR_INCLUDE_H
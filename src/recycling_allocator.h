@@ -0,0 +1,181 @@
+#ifndef RECYCLING_ALLOCATOR_INCLUDE_H
+#define RECYCLING_ALLOCATOR_INCLUDE_H
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+namespace pmv {
+
+namespace detail {
+
+// Blocks freed by a thread, by size class, for the next allocations of the same
+// class to reuse. It is trivially destructible, so it stays usable until the
+// thread exits, after block_cache_cleanup released its blocks.
+struct block_cache {
+    // Classes are powers of two from min_block_size to max_block_size
+    constexpr static std::size_t min_block_size = 16;
+    constexpr static std::size_t class_count = 7;
+    constexpr static std::size_t max_block_size = min_block_size << (class_count - 1);
+    // Blocks kept per class, beyond that they are freed
+    constexpr static std::size_t max_blocks = 64;
+
+    struct free_block {
+        free_block* next;
+    };
+
+    free_block* heads[class_count];
+    std::size_t counts[class_count];
+    bool closed;
+};
+
+inline block_cache& thread_block_cache() noexcept
+{
+    static thread_local block_cache cache{};
+    return cache;
+}
+
+struct block_cache_cleanup {
+    ~block_cache_cleanup()
+    {
+        auto& cache = thread_block_cache();
+        for (std::size_t i = 0; i < block_cache::class_count; ++i) {
+            while (auto* const block = cache.heads[i]) {
+                cache.heads[i] = block->next;
+                ::operator delete(block);
+            }
+            cache.counts[i] = 0;
+        }
+        // Blocks freed by later thread_local destructors are freed right away
+        cache.closed = true;
+    }
+};
+
+// Index of the class of blocks holding bytes, class_count if none does
+inline std::size_t block_class(std::size_t bytes) noexcept
+{
+    std::size_t index = 0;
+    for (auto size = block_cache::min_block_size; size < bytes; size *= 2) {
+        if (++index == block_cache::class_count) {
+            break;
+        }
+    }
+    return index;
+}
+
+inline bool over_aligned(std::size_t alignment) noexcept
+{
+#ifdef __STDCPP_DEFAULT_NEW_ALIGNMENT__
+    return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+#else
+    return alignment > alignof(std::max_align_t);
+#endif
+}
+
+inline void* allocate_block(std::size_t bytes, std::size_t alignment)
+{
+    if (over_aligned(alignment)) {
+#if __cpp_aligned_new
+        return ::operator new(bytes, std::align_val_t{alignment});
+#else
+        return ::operator new(bytes);
+#endif
+    }
+
+    auto const index = block_class(bytes);
+    if (index == block_cache::class_count) {
+        return ::operator new(bytes);
+    }
+
+    auto& cache = thread_block_cache();
+    if (auto* const block = cache.heads[index]) {
+        cache.heads[index] = block->next;
+        --cache.counts[index];
+        return block;
+    }
+    return ::operator new(block_cache::min_block_size << index);
+}
+
+inline void deallocate_block(void* ptr, std::size_t bytes, std::size_t alignment) noexcept
+{
+    if (over_aligned(alignment)) {
+#if __cpp_aligned_new
+        ::operator delete(ptr, std::align_val_t{alignment});
+#else
+        ::operator delete(ptr);
+#endif
+        return;
+    }
+
+    auto const index = block_class(bytes);
+    auto& cache = thread_block_cache();
+    if (index == block_cache::class_count || cache.closed
+        || cache.counts[index] == block_cache::max_blocks) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    // Registers the release of the cached blocks at thread exit
+    static thread_local block_cache_cleanup cleanup;
+    (void)cleanup;
+
+    auto* const block = static_cast<block_cache::free_block*>(ptr);
+    block->next = cache.heads[index];
+    cache.heads[index] = block;
+    ++cache.counts[index];
+}
+
+} // namespace detail
+
+// Stateless allocator recycling the blocks it frees. Sizes are rounded up to
+// power of two classes, and freed blocks are kept in a per thread list for
+// their class, so an object replaced by another of the same class, as with
+// polymorphic_value::emplace or cross type assignment, takes the block that
+// was just released instead of a free and a malloc.
+//
+// Blocks larger than block_cache::max_block_size or over aligned aren't
+// recycled. Blocks can be freed by any thread.
+template<typename T>
+class recycling_allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+
+    recycling_allocator() noexcept = default;
+
+    template<typename U>
+    recycling_allocator(recycling_allocator<U> const&) noexcept
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc{};
+        }
+        return static_cast<T*>(detail::allocate_block(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept
+    {
+        detail::deallocate_block(ptr, n * sizeof(T), alignof(T));
+    }
+};
+
+template<typename T, typename U>
+bool operator==(recycling_allocator<T> const&, recycling_allocator<U> const&) noexcept
+{
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(recycling_allocator<T> const&, recycling_allocator<U> const&) noexcept
+{
+    return false;
+}
+
+} // pmv
+
+#endif // RECYCLING_ALLOCATOR_INCLUDE_H
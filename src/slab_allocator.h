@@ -0,0 +1,161 @@
+#ifndef SLAB_ALLOCATOR_INCLUDE_H
+#define SLAB_ALLOCATOR_INCLUDE_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+namespace pmv {
+
+namespace detail {
+
+// Blocks of a single size, carved in address order from slabs of slab_size
+// bytes. Freed blocks are reused before the slab is extended, most recently
+// freed first. Slabs are kept until the pool is destroyed.
+class slab_pool {
+public:
+    constexpr static std::size_t slab_size = 16 * 1024;
+    // Larger blocks don't come from slabs
+    constexpr static std::size_t max_block_size = 1024;
+
+    explicit slab_pool(std::size_t block_size) noexcept
+        : m_block_size{block_size < sizeof(free_block) ? sizeof(free_block) : block_size}
+    {
+    }
+
+    slab_pool(slab_pool const&) = delete;
+    slab_pool& operator=(slab_pool const&) = delete;
+
+    ~slab_pool()
+    {
+        while (m_slabs) {
+            auto* const slab = m_slabs;
+            m_slabs = slab->next;
+            ::operator delete(slab);
+        }
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (auto* const block = m_free) {
+            m_free = block->next;
+            return block;
+        }
+        if (m_end - m_next < static_cast<std::ptrdiff_t>(m_block_size)) {
+            add_slab();
+        }
+        void* const block = m_next;
+        m_next += m_block_size;
+        return block;
+    }
+
+    void deallocate(void* ptr) noexcept
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        auto* const block = static_cast<free_block*>(ptr);
+        block->next = m_free;
+        m_free = block;
+    }
+
+private:
+    struct free_block {
+        free_block* next;
+    };
+
+    // Header of a slab, followed by its blocks
+    struct alignas(std::max_align_t) slab {
+        slab* next;
+    };
+
+    void add_slab()
+    {
+        auto* const s = static_cast<slab*>(::operator new(slab_size));
+        s->next = m_slabs;
+        m_slabs = s;
+        m_next = reinterpret_cast<char*>(s + 1);
+        m_end = reinterpret_cast<char*>(s) + slab_size;
+    }
+
+    std::mutex m_mutex;
+    free_block* m_free = nullptr;
+    char* m_next = nullptr;
+    char* m_end = nullptr;
+    slab* m_slabs = nullptr;
+    std::size_t const m_block_size;
+};
+
+template<typename T>
+constexpr bool slab_allocated = sizeof(T) <= slab_pool::max_block_size
+                                && alignof(T) <= alignof(std::max_align_t);
+
+// The pool of the blocks of type T. It is never destroyed, so that values
+// destroyed by static destructors can still free their objects.
+template<typename T>
+slab_pool& slab_pool_for()
+{
+    static slab_pool* const pool = new slab_pool{sizeof(T)};
+    return *pool;
+}
+
+} // namespace detail
+
+// Stateless allocator taking objects of each type from slabs shared by all
+// the objects of that type. As polymorphic_value rebinds its allocator to the
+// type of its object, the heap objects of values built one after the other,
+// like the elements of a vector, are next to each other in memory instead of
+// in separate blocks scattered in the heap, and iterating over them walks
+// memory in order.
+//
+// Pools are shared by all threads, behind a mutex. Arrays, blocks larger than
+// slab_pool::max_block_size and over aligned types are allocated by
+// std::allocator.
+template<typename T>
+class slab_allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+
+    slab_allocator() noexcept = default;
+
+    template<typename U>
+    slab_allocator(slab_allocator<U> const&) noexcept
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (detail::slab_allocated<T> && n == 1) {
+            return static_cast<T*>(detail::slab_pool_for<T>().allocate());
+        }
+        return std::allocator<T>{}.allocate(n);
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept
+    {
+        if (detail::slab_allocated<T> && n == 1) {
+            detail::slab_pool_for<T>().deallocate(ptr);
+        } else {
+            std::allocator<T>{}.deallocate(ptr, n);
+        }
+    }
+};
+
+template<typename T, typename U>
+bool operator==(slab_allocator<T> const&, slab_allocator<U> const&) noexcept
+{
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(slab_allocator<T> const&, slab_allocator<U> const&) noexcept
+{
+    return false;
+}
+
+} // pmv
+
+#endif // SLAB_ALLOCATOR_INCLUDE_H
@@ -0,0 +1,359 @@
+#ifndef TYPE_REGISTRY_INCLUDE_H
+#define TYPE_REGISTRY_INCLUDE_H
+
+#include "polymorphic_value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pmv {
+
+struct serialization_error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+template<std::size_t Size>
+struct unsigned_of_size;
+
+template<>
+struct unsigned_of_size<1> {
+    using type = std::uint8_t;
+};
+
+template<>
+struct unsigned_of_size<2> {
+    using type = std::uint16_t;
+};
+
+template<>
+struct unsigned_of_size<4> {
+    using type = std::uint32_t;
+};
+
+template<>
+struct unsigned_of_size<8> {
+    using type = std::uint64_t;
+};
+
+// Integers and enums are written in little-endian byte order
+template<typename T>
+constexpr bool has_fixed_byte_order = std::is_integral<T>::value || std::is_enum<T>::value;
+
+} // namespace detail
+
+// Appends bytes to a buffer. Integers and enums are written in little-endian
+// byte order, so buffers can be read back on hosts of any endianness. Objects
+// meant to be read on other hosts write all their fields that way.
+class byte_writer {
+public:
+    explicit byte_writer(std::vector<unsigned char>& buffer) noexcept : m_buffer{&buffer} {}
+
+    void write(void const* data, std::size_t size)
+    {
+        auto const* const bytes = static_cast<unsigned char const*>(data);
+        m_buffer->insert(m_buffer->end(), bytes, bytes + size);
+    }
+
+    // Bytes of t, in little-endian byte order for integers and enums, in native
+    // byte order for other types
+    template<typename T>
+    void write(T const& t)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Type can't be copied as bytes");
+        if constexpr (detail::has_fixed_byte_order<T>) {
+            using unsigned_t = typename detail::unsigned_of_size<sizeof(T)>::type;
+            auto const u = static_cast<unsigned_t>(t);
+            unsigned char bytes[sizeof(T)];
+            for (std::size_t i = 0; i < sizeof(T); ++i) {
+                bytes[i] = static_cast<unsigned char>(u >> (8 * i));
+            }
+            write(bytes, sizeof(T));
+        } else {
+            write(&t, sizeof(T));
+        }
+    }
+
+private:
+    std::vector<unsigned char>* m_buffer;
+};
+
+// Reads bytes from a contiguous buffer, which must outlive the objects
+// keeping pointers returned by take()
+class byte_reader {
+public:
+    byte_reader(void const* data, std::size_t size) noexcept
+        : m_position{static_cast<unsigned char const*>(data)}
+        , m_end{m_position + size}
+    {
+    }
+
+    explicit byte_reader(std::vector<unsigned char> const& buffer) noexcept
+        : byte_reader(buffer.data(), buffer.size())
+    {
+    }
+
+    // The next size bytes, without copying them
+    unsigned char const* take(std::size_t size)
+    {
+        if (size > remaining()) {
+            throw serialization_error{"Unexpected end of buffer"};
+        }
+        auto const* const bytes = m_position;
+        m_position += size;
+        return bytes;
+    }
+
+    void read(void* data, std::size_t size) { std::memcpy(data, take(size), size); }
+
+    // Value written by byte_writer::write<T>
+    template<typename T>
+    T read()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Type can't be copied as bytes");
+        if constexpr (detail::has_fixed_byte_order<T>) {
+            using unsigned_t = typename detail::unsigned_of_size<sizeof(T)>::type;
+            auto const* const bytes = take(sizeof(T));
+            unsigned_t u = 0;
+            for (std::size_t i = 0; i < sizeof(T); ++i) {
+                u = static_cast<unsigned_t>(u | static_cast<unsigned_t>(bytes[i]) << (8 * i));
+            }
+            return static_cast<T>(u);
+        } else {
+            T t;
+            read(&t, sizeof(T));
+            return t;
+        }
+    }
+
+    std::size_t remaining() const noexcept { return static_cast<std::size_t>(m_end - m_position); }
+
+private:
+    unsigned char const* m_position;
+    unsigned char const* m_end;
+};
+
+// How a Derived is written and read back. By default, with its
+// serialize(byte_writer&) const member and its constructor from a
+// byte_reader&, which builds the object directly in the storage of the value.
+template<typename Derived>
+struct serialization_traits {
+    static void serialize(Derived const& d, byte_writer& out) { d.serialize(out); }
+};
+
+// Types that values of the given type can serialize, with the stable ids
+// written before their objects, in little-endian byte order. Objects are read
+// by building them in place from the buffer, without a temporary object.
+//
+// The types are registered before the registry is used, after which it can be
+// used by any number of threads.
+template<typename Value>
+class type_registry {
+public:
+    using value_type = Value;
+    using allocator_type = typename Value::allocator_type;
+    using id_type = std::uint32_t;
+
+    // Throws std::invalid_argument if the type or the id is already registered
+    template<typename Derived>
+    void add(id_type id)
+    {
+        static_assert(std::is_constructible<Derived, byte_reader&>::value,
+                      "Type isn't constructible from a byte_reader");
+
+        auto const key = keys_t::template of<Derived>();
+        auto const key_it = lower_bound(m_by_key, key);
+        auto const id_it = lower_bound(m_by_id, id);
+        if ((key_it != m_by_key.end() && key_it->first == key)
+            || (id_it != m_by_id.end() && id_it->first == id)) {
+            throw std::invalid_argument{"Type or id already registered"};
+        }
+
+        // Nothing can throw once the vectors have room for the new type, so a
+        // failure leaves the registry unchanged
+        auto const key_position = key_it - m_by_key.begin();
+        auto const id_position = id_it - m_by_id.begin();
+        reserve_one(m_entries);
+        reserve_one(m_by_key);
+        reserve_one(m_by_id);
+
+        auto const index = m_entries.size();
+        m_entries.push_back(
+            entry{id, serialize_object<Derived>, make<Derived>, construct<Derived>});
+        m_by_key.emplace(m_by_key.begin() + key_position, key, index);
+        m_by_id.emplace(m_by_id.begin() + id_position, id, index);
+    }
+
+    template<typename Derived>
+    bool contains() const noexcept
+    {
+        return find(m_by_key, keys_t::template of<Derived>()) != nullptr;
+    }
+
+    bool contains(id_type id) const noexcept { return find(m_by_id, id) != nullptr; }
+
+    // Write the id of the type of the object followed by the object. Throws
+    // serialization_error if the type isn't registered.
+    void serialize(Value const& value, byte_writer& out) const
+    {
+        write(entry_of(value), value, out);
+    }
+
+    // Write n values. Consecutive values of the same type are written with a
+    // single lookup.
+    void serialize_n(Value const* first, std::size_t n, byte_writer& out) const
+    {
+        void const* previous_key = nullptr;
+        entry const* e = nullptr;
+        for (std::size_t i = 0; i < n; ++i) {
+            auto const key = keys_t::of(first[i]);
+            if (!e || key != previous_key) {
+                e = &entry_of(key);
+                previous_key = key;
+            }
+            write(*e, first[i], out);
+        }
+    }
+
+    // Read a value written by serialize. Throws serialization_error if the id
+    // isn't registered or the buffer ends too early.
+    Value deserialize(byte_reader& in) const { return deserialize(std::allocator_arg, {}, in); }
+
+    Value deserialize(std::allocator_arg_t, allocator_type const& alloc, byte_reader& in) const
+    {
+        return entry_of(in.read<id_type>()).make(alloc, in);
+    }
+
+    // Read n values into uninitialized memory. If reading one throws, the
+    // values already read are destroyed. Returns the end of the read values.
+    Value* deserialize_n(byte_reader& in, std::size_t n, Value* d_first) const
+    {
+        return deserialize_n(std::allocator_arg, {}, in, n, d_first);
+    }
+
+    Value* deserialize_n(std::allocator_arg_t,
+                         allocator_type const& alloc,
+                         byte_reader& in,
+                         std::size_t n,
+                         Value* d_first) const
+    {
+        std::size_t i = 0;
+        try {
+            id_type previous_id = 0;
+            entry const* e = nullptr;
+            for (; i < n; ++i) {
+                auto const id = in.read<id_type>();
+                if (!e || id != previous_id) {
+                    e = &entry_of(id);
+                    previous_id = id;
+                }
+                e->construct(d_first + i, alloc, in);
+            }
+        } catch (...) {
+            pmv::destroy_n(d_first, i);
+            throw;
+        }
+        return d_first + n;
+    }
+
+private:
+    using keys_t = detail::type_keys<Value>;
+
+    struct entry {
+        id_type id;
+        void (*serialize)(Value const& value, byte_writer& out);
+        Value (*make)(allocator_type const& alloc, byte_reader& in);
+        // Build a value into uninitialized memory
+        void (*construct)(void* dst, allocator_type const& alloc, byte_reader& in);
+    };
+
+    template<typename Derived>
+    static void serialize_object(Value const& value, byte_writer& out)
+    {
+        serialization_traits<Derived>::serialize(static_cast<Derived const&>(*value), out);
+    }
+
+    template<typename Derived>
+    static Value make(allocator_type const& alloc, byte_reader& in)
+    {
+        return Value{std::allocator_arg, alloc, in_place_type<Derived>, in};
+    }
+
+    template<typename Derived>
+    static void construct(void* dst, allocator_type const& alloc, byte_reader& in)
+    {
+        new (dst) Value{std::allocator_arg, alloc, in_place_type<Derived>, in};
+    }
+
+    template<typename T>
+    static void reserve_one(std::vector<T>& v)
+    {
+        if (v.size() == v.capacity()) {
+            v.reserve(std::max<std::size_t>(1, 2 * v.capacity()));
+        }
+    }
+
+    static void write(entry const& e, Value const& value, byte_writer& out)
+    {
+        out.write(e.id);
+        e.serialize(value, out);
+    }
+
+    entry const& entry_of(Value const& value) const { return entry_of(keys_t::of(value)); }
+
+    entry const& entry_of(void const* key) const
+    {
+        auto const* const e = find(m_by_key, key);
+        if (!e) {
+            throw serialization_error{"Type not registered"};
+        }
+        return *e;
+    }
+
+    entry const& entry_of(id_type id) const
+    {
+        auto const* const e = find(m_by_id, id);
+        if (!e) {
+            throw serialization_error{"Unknown type id"};
+        }
+        return *e;
+    }
+
+    // Indexes are sorted vectors of (key, index in m_entries), which take less
+    // space than a hash table and are searched faster for a few hundreds types
+    template<typename Key>
+    using index_t = std::vector<std::pair<Key, std::size_t>>;
+
+    template<typename Key>
+    static typename index_t<Key>::const_iterator lower_bound(index_t<Key> const& index, Key key)
+    {
+        return std::lower_bound(index.begin(), index.end(), key, [](auto const& e, Key k) {
+            return std::less<Key>{}(e.first, k);
+        });
+    }
+
+    template<typename Key>
+    entry const* find(index_t<Key> const& index, Key key) const noexcept
+    {
+        auto const it = lower_bound(index, key);
+        return it != index.end() && it->first == key ? &m_entries[it->second] : nullptr;
+    }
+
+    std::vector<entry> m_entries;
+    index_t<void const*> m_by_key;
+    index_t<id_type> m_by_id;
+};
+
+} // pmv
+
+#endif // TYPE_REGISTRY_INCLUDE_H